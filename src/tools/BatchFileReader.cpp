@@ -0,0 +1,462 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "BatchFileReader.h"
+#include "RawFile.h"
+#include "Threadpool.h"
+
+#include <cassert>
+#include <deque>
+
+#ifdef __linux__
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+// liburing isn't a dependency, the ring is driven through the raw system calls
+struct BatchFileReader::Ring {
+    int           fd        = -1;
+    unsigned      entries   = 0;
+    void*         sqMap     = MAP_FAILED;
+    size_t        sqMapSize = 0;
+    void*         cqMap     = MAP_FAILED;
+    size_t        cqMapSize = 0;
+    io_uring_sqe* sqes      = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t        sqesSize  = 0;
+
+    // Shared with the kernel
+    unsigned*     sqHead    = nullptr;
+    unsigned*     sqTail    = nullptr;
+    unsigned*     sqArray   = nullptr;
+    unsigned      sqMask    = 0;
+    unsigned*     cqHead    = nullptr;
+    unsigned*     cqTail    = nullptr;
+    io_uring_cqe* cqes      = nullptr;
+    unsigned      cqMask    = 0;
+
+    unsigned      localTail = 0; // SQEs written so far, published to the kernel by submitAndWait()
+
+    ~Ring() {
+        if (sqes != MAP_FAILED) { munmap(sqes, sqesSize); }
+        if (cqMap != MAP_FAILED && cqMap != sqMap) { munmap(cqMap, cqMapSize); }
+        if (sqMap != MAP_FAILED) { munmap(sqMap, sqMapSize); }
+        if (fd >= 0) { ::close(fd); }
+    }
+
+    static std::unique_ptr<Ring> create(unsigned numEntries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        auto ring = std::make_unique<Ring>();
+        ring->fd  = int(syscall(__NR_io_uring_setup, numEntries, &params));
+        if (ring->fd < 0) return nullptr;
+
+        ring->entries   = params.sq_entries;
+        ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        ring->sqesSize  = params.sq_entries * sizeof(io_uring_sqe);
+
+        const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap) {
+            ring->sqMapSize = ring->cqMapSize = std::max(ring->sqMapSize, ring->cqMapSize);
+        }
+
+        ring->sqMap = mmap(nullptr, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sqMap == MAP_FAILED) return nullptr;
+
+        ring->cqMap = singleMap ? ring->sqMap
+                                : mmap(nullptr, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED) return nullptr;
+
+        ring->sqes = static_cast<io_uring_sqe*>(mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES));
+        if (ring->sqes == MAP_FAILED) return nullptr;
+
+        char* sq = static_cast<char*>(ring->sqMap);
+        char* cq = static_cast<char*>(ring->cqMap);
+        ring->sqHead    = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        ring->sqTail    = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        ring->sqArray   = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        ring->sqMask    = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        ring->cqHead    = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        ring->cqTail    = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        ring->cqes      = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        ring->cqMask    = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        ring->localTail = *ring->sqTail;
+
+        // Opening and closing through the ring needs 5.6, earlier kernels take the pooled path
+        std::vector<char> probeBuf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe*   probe = reinterpret_cast<io_uring_probe*>(probeBuf.data());
+        if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) return nullptr;
+        for (const unsigned op : { unsigned(IORING_OP_OPENAT), unsigned(IORING_OP_READ), unsigned(IORING_OP_CLOSE) }) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return nullptr;
+        }
+        return ring;
+    }
+
+    // Next SQE, cleared. The caller makes sure there is room.
+    io_uring_sqe* prepare() {
+        const unsigned index = localTail & sqMask;
+        sqArray[index]       = index;
+        localTail++;
+
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // Hands every prepared SQE to the kernel and waits for at least minComplete completions
+    void submitAndWait(unsigned minComplete) {
+        std::atomic_ref<unsigned>(*sqTail).store(localTail, std::memory_order_release);
+        const unsigned toSubmit = localTail - std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire);
+
+        while (syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0) < 0) {
+            if (errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+        }
+    }
+
+    // Takes back the prepared SQEs the kernel hasn't consumed and returns how many. Without
+    // SQPOLL the kernel only reads the queue inside io_uring_enter, so those never run.
+    unsigned withdraw() {
+        const unsigned head      = std::atomic_ref<unsigned>(*sqHead).load(std::memory_order_acquire);
+        const unsigned withdrawn = localTail - head;
+        localTail = head;
+        std::atomic_ref<unsigned>(*sqTail).store(localTail, std::memory_order_release);
+        return withdrawn;
+    }
+
+    // Each CQE is copied out and given back before onComplete sees it, so one that throws
+    // leaves the rest of the queue to be reaped again
+    template <typename OnComplete>
+    void reap(OnComplete&& onComplete) {
+        unsigned       head = *cqHead; // Only this thread moves the head
+        const unsigned tail = std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire);
+        while (head != tail) {
+            const io_uring_cqe cqe = cqes[head & cqMask];
+            std::atomic_ref<unsigned>(*cqHead).store(++head, std::memory_order_release);
+            onComplete(cqe);
+        }
+    }
+};
+#else
+struct BatchFileReader::Ring {};
+#endif
+
+BatchFileReader::BatchFileReader() : BatchFileReader(Options()) {
+}
+
+BatchFileReader::BatchFileReader(const Options& options) : m_options(options) {
+    m_options.queueDepth   = std::max(m_options.queueDepth, 1u);
+    m_options.maxOpenFiles = std::max(m_options.maxOpenFiles, 1u);
+    m_options.chunkSize    = std::clamp<size_t>(m_options.chunkSize, 4096, 1 << 30);
+
+#ifdef __linux__
+    if (m_options.useIoUring) {
+        m_ring = Ring::create(m_options.queueDepth);
+    }
+#endif
+}
+
+BatchFileReader::~BatchFileReader() = default;
+
+size_t BatchFileReader::read(std::vector<Request>& requests) {
+    for (auto& request : requests) {
+        request.bytesRead = 0;
+        request.error.clear();
+    }
+    if (requests.empty()) return 0;
+
+#ifdef __linux__
+    if (m_ring) {
+        try {
+            return readIoUring(requests);
+        }
+        catch (...) {
+            m_ring.reset(); // readIoUring() has settled every op it queued, the next read() takes the pool
+            throw;
+        }
+    }
+#endif
+    return readPooled(requests);
+}
+
+#ifdef __linux__
+size_t BatchFileReader::readIoUring(std::vector<Request>& requests) {
+    enum class OpKind : uint8_t { Open, Read, Close };
+    struct Op {
+        OpKind   kind    = OpKind::Open;
+        uint32_t request = 0;
+        uint64_t offset  = 0;
+        char*    dst     = nullptr;
+        size_t   length  = 0;
+    };
+    struct File {
+        int      fd       = -1;
+        uint64_t next     = 0;     // Offset of the next chunk to read
+        uint64_t end      = 0;
+        size_t   inFlight = 0;     // Reads queued or running
+        bool     stop     = false; // Hit the end of the file or an error, no more reads
+        bool     closing  = false;
+    };
+
+    // Every op holds one slot until it completes, and the ring has at least as many entries as
+    // there are slots, so the submission queue can never overflow
+    const unsigned        numSlots = std::min(m_ring->entries, m_options.queueDepth);
+    std::vector<Op>       ops(numSlots);
+    std::vector<uint32_t> freeSlots;
+    for (unsigned slot = numSlots; slot-- > 0;) {
+        freeSlots.push_back(slot);
+    }
+
+    std::vector<File>    files(requests.size());
+    std::deque<uint32_t> reading; // Open files with chunks left to queue, served round robin
+    std::deque<uint32_t> closing;
+    std::deque<uint32_t> retries; // Slots of reads to queue again, after a short read or EINTR
+    size_t               nextOpen  = 0;
+    size_t               numOpen   = 0;
+    size_t               numDone   = 0;
+    size_t               numQueued = 0; // Ops handed to the ring whose CQE hasn't been reaped
+
+    auto takeSlot = [&freeSlots]() {
+        const uint32_t slot = freeSlots.back();
+        freeSlots.pop_back();
+        return slot;
+    };
+    auto queue = [&](uint32_t slot) {
+        const Op&     op  = ops[slot];
+        io_uring_sqe* sqe = m_ring->prepare();
+        sqe->user_data    = slot;
+        numQueued++;
+        switch (op.kind) {
+        case OpKind::Open:
+            sqe->opcode     = IORING_OP_OPENAT;
+            sqe->fd         = AT_FDCWD;
+            sqe->addr       = reinterpret_cast<uintptr_t>(requests[op.request].path.c_str());
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            break;
+        case OpKind::Read:
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd     = files[op.request].fd;
+            sqe->addr   = reinterpret_cast<uintptr_t>(op.dst);
+            sqe->len    = unsigned(op.length);
+            sqe->off    = op.offset;
+            break;
+        case OpKind::Close:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd     = files[op.request].fd;
+            break;
+        }
+    };
+    auto fail = [&requests, &files](uint32_t i, int error) {
+        if (!requests[i].error) {
+            requests[i].error = std::error_code(error, std::generic_category());
+        }
+        files[i].stop = true;
+    };
+    auto closeWhenDone = [&files, &closing](uint32_t i) {
+        File& file = files[i];
+        if (!file.closing && file.inFlight == 0 && (file.stop || file.next >= file.end)) {
+            file.closing = true;
+            closing.push_back(i);
+        }
+    };
+
+    try {
+        while (numDone < requests.size()) {
+            for (const uint32_t slot : retries) {
+                queue(slot);
+            }
+            retries.clear();
+
+            // Closes first to free descriptors, then reads so open files finish before new ones start
+            while (!closing.empty() && !freeSlots.empty()) {
+                const uint32_t slot = takeSlot();
+                ops[slot]           = Op{ OpKind::Close, closing.front() };
+                queue(slot);
+                closing.pop_front();
+            }
+            while (!reading.empty() && !freeSlots.empty()) {
+                const uint32_t i    = reading.front();
+                File&          file = files[i];
+                reading.pop_front();
+                if (file.stop || file.next >= file.end) continue;
+
+                const size_t   length = size_t(std::min<uint64_t>(m_options.chunkSize, file.end - file.next));
+                const uint32_t slot   = takeSlot();
+                ops[slot]             = Op{ OpKind::Read, i, file.next, requests[i].buffer + (file.next - requests[i].offset), length };
+                queue(slot);
+                file.next += length;
+                file.inFlight++;
+
+                // Back of the line, so one huge file doesn't hold up the small ones behind it
+                if (file.next < file.end) {
+                    reading.push_back(i);
+                }
+            }
+            while (nextOpen < requests.size() && numOpen < m_options.maxOpenFiles && !freeSlots.empty()) {
+                const uint32_t slot = takeSlot();
+                ops[slot]           = Op{ OpKind::Open, uint32_t(nextOpen++) };
+                queue(slot);
+                numOpen++;
+            }
+
+            assert(freeSlots.size() < numSlots); // Something has to be in flight, or we'd wait forever
+            m_ring->submitAndWait(1);
+
+            m_ring->reap([&](const io_uring_cqe& cqe) {
+                numQueued--;
+                const uint32_t slot    = uint32_t(cqe.user_data);
+                Op&            op      = ops[slot];
+                const uint32_t i       = op.request;
+                File&          file    = files[i];
+                bool           release = true;
+
+                switch (op.kind) {
+                case OpKind::Open:
+                    if (cqe.res < 0) {
+                        fail(i, -cqe.res);
+                        numOpen--;
+                        numDone++;
+                        break;
+                    }
+                    file.fd   = cqe.res;
+                    file.next = requests[i].offset;
+                    file.end  = requests[i].offset + requests[i].length;
+                    if (file.next < file.end) {
+                        reading.push_back(i);
+                    }
+                    else {
+                        closeWhenDone(i);
+                    }
+                    break;
+
+                case OpKind::Read:
+                    if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+                        release = false;
+                    }
+                    else if (cqe.res < 0) {
+                        fail(i, -cqe.res);
+                    }
+                    else if (cqe.res == 0) {
+                        file.stop = true; // End of the file, the chunks after this one will come back empty too
+                    }
+                    else {
+                        requests[i].bytesRead += size_t(cqe.res);
+                        if (size_t(cqe.res) < op.length) {
+                            op.offset += size_t(cqe.res);
+                            op.dst    += size_t(cqe.res);
+                            op.length -= size_t(cqe.res);
+                            release    = false;
+                        }
+                    }
+
+                    if (release) {
+                        file.inFlight--;
+                        closeWhenDone(i);
+                    }
+                    else {
+                        retries.push_back(slot);
+                    }
+                    break;
+
+                case OpKind::Close:
+                    if (cqe.res < 0 && !requests[i].error) {
+                        requests[i].error = std::error_code(-cqe.res, std::generic_category());
+                    }
+                    file.fd = -1;
+                    numOpen--;
+                    numDone++;
+                    break;
+                }
+
+                if (release) {
+                    freeSlots.push_back(slot);
+                }
+            });
+        }
+    }
+    catch (...) {
+        // The kernel may still be reading into the caller's buffers, so nothing leaves here until
+        // every op it took has completed. Then the descriptors it opened for us are closed here.
+        numQueued -= m_ring->withdraw();
+        while (numQueued > 0) {
+            try {
+                m_ring->submitAndWait(1);
+            }
+            catch (const std::system_error&) {
+                // Likely what failed in the first place, completions still arrive without it
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            m_ring->reap([&](const io_uring_cqe& cqe) {
+                numQueued--;
+                const Op& op = ops[uint32_t(cqe.user_data)];
+                if (op.kind == OpKind::Open && cqe.res >= 0) {
+                    files[op.request].fd = cqe.res;
+                }
+                else if (op.kind == OpKind::Close) {
+                    files[op.request].fd = -1; // Released even if the close reported an error
+                }
+            });
+        }
+        for (const File& file : files) {
+            if (file.fd >= 0) {
+                ::close(file.fd);
+            }
+        }
+        throw;
+    }
+
+    return size_t(std::count_if(requests.begin(), requests.end(), [](const Request& request) { return bool(request.error); }));
+}
+#endif
+
+size_t BatchFileReader::readPooled(std::vector<Request>& requests) {
+    Threadpool::Pool&     pool = Threadpool::pool(Threadpool::PoolId::IO);
+    Threadpool::TaskGroup group;
+    for (auto& request : requests) {
+        pool.submit(group, [&request]() {
+            RawFile file;
+            if (!file.open(request.path)) {
+                request.error = file.error();
+                return;
+            }
+            try {
+                request.bytesRead = file.readAt(request.offset, request.buffer, request.length);
+            }
+            catch (const std::system_error& e) {
+                request.error = e.code();
+            }
+        });
+    }
+    pool.join(group);
+
+    return size_t(std::count_if(requests.begin(), requests.end(), [](const Request& request) { return bool(request.error); }));
+}
@@ -0,0 +1,74 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include "VfCommon.h"
+
+#include <system_error>
+
+// Reads many files in one go, straight into buffers the caller owns. Meant for loading the
+// inputs attached to a graph, where thousands of files each holding one FileReader and
+// one blocking thread would mostly be waiting on the disk.
+// On Linux the opens, reads and closes are all queued on io_uring, so a single thread keeps
+// queueDepth operations in flight. Without io_uring (older kernels, seccomp, other platforms)
+// every file is read with positional reads on the I/O pool instead.
+class BatchFileReader {
+public:
+    struct Request {
+        fs::path        path;
+        char*           buffer    = nullptr; // Caller owned, at least length bytes
+        size_t          length    = 0;       // Bytes wanted, reading stops early at the end of the file
+        uint64_t        offset    = 0;       // Where in the file to start
+
+        size_t          bytesRead = 0;       // Set by read()
+        std::error_code error;               // Set by read(), empty on success
+    };
+
+    struct Options {
+        unsigned queueDepth   = 256;     // Operations in flight at once
+        unsigned maxOpenFiles = 128;     // Keeps well clear of the process fd limit
+        size_t   chunkSize    = 1 << 20; // Larger reads are split, so one big file has several reads in flight
+        bool     useIoUring   = true;    // false always takes the I/O pool path
+    };
+
+    BatchFileReader();
+    explicit BatchFileReader(const Options& options);
+    ~BatchFileReader();
+
+    BatchFileReader(const BatchFileReader&)            = delete;
+    BatchFileReader& operator=(const BatchFileReader&) = delete;
+
+    // Reads every request and blocks until all are done. Returns how many failed, why is in
+    // their Request::error. A failure never stops the other requests.
+    size_t read(std::vector<Request>& requests);
+
+    bool usesIoUring() const { return m_ring != nullptr; }
+
+private:
+    struct Ring;
+
+    size_t readIoUring(std::vector<Request>& requests);
+    size_t readPooled(std::vector<Request>& requests);
+
+    Options               m_options;
+    std::unique_ptr<Ring> m_ring; // Null when io_uring isn't available
+};
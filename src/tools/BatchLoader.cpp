@@ -0,0 +1,270 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "BatchLoader.h"
+#include "RawFile.h"
+#include "Threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+    // Counting semaphore over the files open for loading, process wide so that several loaders
+    // running at once still stay inside it
+    class OpenFileBudget {
+    public:
+        static OpenFileBudget& global() {
+            static OpenFileBudget budget;
+            return budget;
+        }
+
+        // help runs pool work while the budget is spent, see load()
+        void acquire(const std::function<bool()>& help) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_inUse >= m_limit) {
+                lock.unlock();
+                const bool helped = help();
+                lock.lock();
+                if (!helped) {
+                    m_released.wait_for(lock, std::chrono::milliseconds(1), [this]() { return m_inUse < m_limit; });
+                }
+            }
+            m_inUse++;
+        }
+        void release() {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_inUse--;
+            }
+            m_released.notify_one();
+        }
+
+        void setLimit(size_t limit) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_limit = std::max<size_t>(limit, 1);
+            }
+            m_released.notify_all();
+        }
+        size_t limit() {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_limit;
+        }
+
+    private:
+        std::mutex              m_mutex;
+        std::condition_variable m_released;
+        size_t                  m_limit = 256;
+        size_t                  m_inUse = 0;
+    };
+
+    // One file's worth of the budget, handed from the dispatching thread to the read task
+    class FileSlot {
+    public:
+        explicit FileSlot(const std::function<bool()>& help) : m_held(true) { OpenFileBudget::global().acquire(help); }
+        ~FileSlot() { release(); }
+
+        FileSlot(FileSlot&& other) noexcept : m_held(other.m_held) { other.m_held = false; }
+        FileSlot(const FileSlot&)            = delete;
+        FileSlot& operator=(const FileSlot&) = delete;
+        FileSlot& operator=(FileSlot&&)      = delete;
+
+        void release() {
+            if (m_held) {
+                OpenFileBudget::global().release();
+                m_held = false;
+            }
+        }
+
+    private:
+        bool m_held;
+    };
+}
+
+// A buffer on loan to one file. Tasks own it by value, so it goes back to the pool however the
+// task ends: parsed, failed to read, or skipped because the batch was cancelled.
+class BatchLoader::BufferLease {
+public:
+    BufferLease(BatchLoader& loader, Buffer&& buffer) : m_loader(&loader), m_buffer(std::move(buffer)) {}
+    ~BufferLease() {
+        if (m_loader) {
+            m_loader->returnBuffer(std::move(m_buffer));
+        }
+    }
+
+    BufferLease(BufferLease&& other) noexcept : m_loader(other.m_loader), m_buffer(std::move(other.m_buffer)) { other.m_loader = nullptr; }
+    BufferLease(const BufferLease&)            = delete;
+    BufferLease& operator=(const BufferLease&) = delete;
+    BufferLease& operator=(BufferLease&&)      = delete;
+
+    const char* data() const { return m_buffer.data.get(); }
+
+    char* reserve(size_t size) {
+        if (size > m_buffer.capacity) {
+            // Grow past what is needed, so a batch of slowly increasing sizes doesn't reallocate every time
+            const size_t capacity = std::max(size, m_buffer.capacity * 2);
+            m_loader->resized(m_buffer.capacity, capacity);
+            m_buffer.data.reset(new char[capacity]);
+            m_buffer.capacity = capacity;
+        }
+        return m_buffer.data.get();
+    }
+
+private:
+    BatchLoader* m_loader;
+    Buffer       m_buffer;
+};
+
+BatchLoader::BatchLoader()
+    : BatchLoader(Options())
+{
+}
+
+BatchLoader::BatchLoader(const Options& options)
+    : m_options(options)
+{
+    m_options.maxBuffers = std::max<size_t>(m_options.maxBuffers, 1);
+}
+
+BatchLoader::~BatchLoader() = default;
+
+void BatchLoader::setOpenFileLimit(size_t limit) {
+    OpenFileBudget::global().setLimit(limit);
+}
+
+size_t BatchLoader::openFileLimit() {
+    return OpenFileBudget::global().limit();
+}
+
+size_t BatchLoader::load(const std::vector<fs::path>& paths, const ParseFunc& parse) {
+    m_errors.assign(paths.size(), std::error_code());
+
+    // Parsing goes to the compute pool, unless it has no workers of its own: then nothing would
+    // run the parses until the join below, while this thread waits on the buffers they hold
+    Threadpool::Pool& ioPool    = Threadpool::pool(Threadpool::PoolId::IO);
+    Threadpool::Pool& parsePool = Threadpool::pool().num_threads() > 0 ? Threadpool::pool() : ioPool;
+
+    // Shared by every task of the batch, which then only capture a pointer to it and stay small
+    // enough to be queued without allocating
+    Threadpool::TaskGroup group; // Reads and parses alike, so a parse that throws also stops the reads
+    struct Batch {
+        const std::vector<fs::path>& paths;
+        const ParseFunc&             parse;
+        Threadpool::Pool&            parsePool;
+        Threadpool::TaskGroup&       group;
+    } batch{paths, parse, parsePool, group};
+
+    // Waiting for a buffer or a file slot runs queued reads and parses rather than blocking. load()
+    // may itself be running on a worker, and with every worker waiting in here nothing would be
+    // left to finish the files that hold them. Same if the I/O pool has no workers at all.
+    const std::function<bool()> help = [&ioPool, &parsePool]() { return ioPool.run_one() || parsePool.run_one(); };
+
+    for (size_t index = 0; index < paths.size(); ++index) {
+        // Buffer before file handle, so a handle is never held waiting for memory
+        BufferLease buffer(*this, acquireBuffer(help));
+        if (group.cancelled()) break;
+        FileSlot slot(help);
+
+        ioPool.submit(group, [this, &batch, index, buffer = std::move(buffer), slot = std::move(slot)]() mutable {
+            size_t bytesRead = 0;
+            {
+                RawFile file;
+                if (!file.open(batch.paths[index])) {
+                    m_errors[index] = file.error();
+                    return;
+                }
+                try {
+                    const uint64_t size = file.size();
+                    bytesRead = file.readAt(0, buffer.reserve(size_t(size)), size_t(size));
+                }
+                catch (const std::system_error& e) {
+                    m_errors[index] = e.code();
+                    return;
+                }
+            }
+            slot.release(); // Closed, the next file can open
+
+            batch.parsePool.submit(batch.group, [&batch, index, bytesRead, buffer = std::move(buffer)]() {
+                batch.parse(index, std::string_view(buffer.data(), bytesRead));
+            });
+        });
+    }
+    // The join only helps the parse pool, so the reads still queued are run here first. Any read
+    // already running elsewhere submits its parse, which the join then picks up.
+    while (ioPool.run_one()) {}
+    parsePool.join(group);
+
+    return size_t(std::count_if(m_errors.begin(), m_errors.end(), [](const std::error_code& error) { return bool(error); }));
+}
+
+void BatchLoader::releaseBuffers() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto& buffer : m_idle) {
+        m_bufferBytes -= buffer.capacity;
+    }
+    m_numBuffers -= m_idle.size();
+    m_idle.clear();
+}
+
+size_t BatchLoader::bufferBytes() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_bufferBytes;
+}
+
+BatchLoader::Buffer BatchLoader::acquireBuffer(const std::function<bool()>& help) {
+    const auto available = [this]() { return !m_idle.empty() || m_numBuffers < m_options.maxBuffers; };
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!available()) {
+        lock.unlock();
+        const bool helped = help();
+        lock.lock();
+        if (!helped) {
+            m_returned.wait_for(lock, std::chrono::milliseconds(1), available);
+        }
+    }
+
+    Buffer buffer;
+    if (!m_idle.empty()) {
+        buffer = std::move(m_idle.back());
+        m_idle.pop_back();
+    }
+    else {
+        buffer.data.reset(new char[m_options.bufferSize]);
+        buffer.capacity = m_options.bufferSize;
+        m_numBuffers++;
+        m_bufferBytes += buffer.capacity;
+    }
+    return buffer;
+}
+
+void BatchLoader::returnBuffer(Buffer&& buffer) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_idle.push_back(std::move(buffer));
+    }
+    m_returned.notify_one();
+}
+
+void BatchLoader::resized(size_t oldCapacity, size_t newCapacity) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bufferBytes += newCapacity - oldCapacity;
+}
@@ -0,0 +1,106 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include "VfCommon.h"
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+// Loads and parses a list of files, handing each file's contents to the parser as soon as it
+// has been read rather than after the whole batch. Replaces building a FileReader per input:
+// the files are read whole into buffers that are recycled from one file (and one load()) to
+// the next, so memory is bounded by maxBuffers and steady state does no per-file allocation.
+// Reads run on the I/O pool, parsing on the compute pool. The number of files open at once is
+// capped by a budget shared by every loader in the process.
+class BatchLoader {
+public:
+    struct Options {
+        size_t maxBuffers = 16;      // Files read or being parsed at once, each holds one buffer
+        size_t bufferSize = 1 << 20; // Starting capacity, a buffer grows to the largest file it has held
+    };
+
+    // Called once per file that was read, on a worker thread, concurrently with other files.
+    // contents is only valid for the duration of the call.
+    using ParseFunc = std::function<void(size_t index, std::string_view contents)>;
+
+    BatchLoader();
+    explicit BatchLoader(const Options& options);
+    ~BatchLoader();
+
+    BatchLoader(const BatchLoader&)            = delete;
+    BatchLoader& operator=(const BatchLoader&) = delete;
+
+    // Reads and parses every file and blocks until all are done. Returns how many files couldn't
+    // be read, why is in errors(). A read failure never stops the other files, an exception from
+    // parse cancels the rest of the batch and is rethrown here. The calling thread works on the
+    // batch while it waits, so load() can be called from a pool task, and works with no I/O workers.
+    size_t load(const std::vector<fs::path>& paths, const ParseFunc& parse);
+
+    // As above, but parse returns a result for each file, which is passed to deliver as files
+    // complete. deliver is never called concurrently, so it can collect results without locking.
+    template <typename Parse, typename Deliver>
+    size_t load(const std::vector<fs::path>& paths, Parse&& parse, Deliver&& deliver) {
+        std::mutex deliverMutex;
+        return load(paths, ParseFunc([&](size_t index, std::string_view contents) {
+            auto result = parse(index, contents);
+            std::lock_guard<std::mutex> lock(deliverMutex);
+            deliver(index, std::move(result));
+        }));
+    }
+
+    // One per path of the last load(), empty for files that were read
+    const std::vector<std::error_code>& errors() const { return m_errors; }
+
+    void   releaseBuffers();                             // Frees the idle buffers, they are allocated again as needed
+    size_t bufferBytes() const;                          // Capacity of every buffer held, idle or in use
+
+    // Most files every loader in the process may have open at once, 256 by default
+    static void   setOpenFileLimit(size_t limit);
+    static size_t openFileLimit();
+
+private:
+    class BufferLease;
+    friend class BufferLease;
+
+    struct Buffer {
+        std::unique_ptr<char[]> data;
+        size_t                  capacity = 0;
+    };
+
+    Buffer acquireBuffer(const std::function<bool()>& help); // While maxBuffers are in use, calls help until one is returned
+    void   returnBuffer(Buffer&& buffer);
+    void   resized(size_t oldCapacity, size_t newCapacity);
+
+    Options                          m_options;
+    mutable std::mutex               m_mutex;
+    std::condition_variable          m_returned;
+    std::vector<Buffer>              m_idle;
+    size_t                           m_numBuffers  = 0; // Idle and in use
+    size_t                           m_bufferBytes = 0;
+    std::vector<std::error_code>     m_errors;
+};
@@ -0,0 +1,171 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Compile-time description of a fixed-size binary record on disk, and how it maps onto a struct.
+// Each field names the member it is stored into and its byte offset within the record, the byte
+// order is shared by the whole record. Decoding is a loop over records with every field access
+// known at compile time, and a single memcpy when the record on disk is exactly the struct.
+//
+//   struct Sample { double time; float x; float y; uint16_t flags; };
+//
+//   using SampleLayout = RecordLayout<Sample, 24, std::endian::little,   // 24 bytes, 6 of them unused
+//                                     RecordField<&Sample::time,  0>,
+//                                     RecordField<&Sample::x,     8>,
+//                                     RecordField<&Sample::y,     12>,
+//                                     RecordField<&Sample::flags, 16>>;
+//
+//   using PackedSample = PackedRecordLayout<Sample, std::endian::big,     // 18 bytes, no gaps
+//                                           &Sample::time, &Sample::x, &Sample::y, &Sample::flags>;
+//
+// Members without a field are left untouched.
+
+template <typename T>
+inline T byteSwap(T value) {
+    static_assert(std::is_trivially_copyable_v<T>, "Only plain values can be byte swapped");
+    unsigned char bytes[sizeof(T)];
+    memcpy(bytes, &value, sizeof(T));
+    std::reverse(bytes, bytes + sizeof(T)); // Compilers turn this into a single bswap
+    memcpy(&value, bytes, sizeof(T));
+    return value;
+}
+
+template <auto Member, size_t Offset>
+struct RecordField;
+
+template <typename R, typename T, T R::*Member, size_t Offset>
+struct RecordField<Member, Offset> {
+    static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>, "Record fields must be numbers or enums");
+
+    using Owner = R;
+    using Type  = T;
+
+    static constexpr size_t offset = Offset;
+    static constexpr size_t size   = sizeof(T);
+
+    template <std::endian ByteOrder>
+    static T load(const char* record) {
+        T value;
+        memcpy(&value, record + Offset, sizeof(T));
+        if constexpr (ByteOrder != std::endian::native && sizeof(T) > 1) {
+            value = byteSwap(value);
+        }
+        return value;
+    }
+
+    template <std::endian ByteOrder>
+    static void store(const char* record, R& out) { out.*Member = load<ByteOrder>(record); }
+
+    // Where the member sits in the struct, -1 if that can't be worked out
+    static ptrdiff_t memberOffset() {
+        if constexpr (std::is_default_constructible_v<R>) {
+            const R probe{};
+            return reinterpret_cast<const char*>(&(probe.*Member)) - reinterpret_cast<const char*>(&probe);
+        }
+        return -1;
+    }
+};
+
+template <typename R, size_t Size, std::endian ByteOrder, typename... Fields>
+struct RecordLayout {
+    static_assert(sizeof...(Fields) > 0, "A record needs at least one field");
+    static_assert((std::is_same_v<typename Fields::Owner, R> && ...), "Every field must be a member of the record");
+    static_assert(((Fields::offset + Fields::size <= Size) && ...), "Field runs past the end of the record");
+
+    using Record  = R;
+    using Columns = std::tuple<typename Fields::Type*...>; // One array per field, in field order. Null skips the field.
+
+    static constexpr size_t      size      = Size;
+    static constexpr std::endian byteOrder = ByteOrder;
+    static constexpr size_t      numFields = sizeof...(Fields);
+
+    // True when a record on disk is byte for byte the in-memory Record, so batches are copied whole
+    static bool isMemoryLayout() {
+        if constexpr (ByteOrder == std::endian::native && Size == sizeof(R) && std::is_trivially_copyable_v<R> &&
+                      (Fields::size + ...) == sizeof(R)) {
+            static const bool ret = ((Fields::memberOffset() == ptrdiff_t(Fields::offset)) && ...);
+            return ret;
+        }
+        return false;
+    }
+
+    // Array of structs: count records from src into out[0, count)
+    static void decode(const char* src, size_t count, R* out) {
+        if (isMemoryLayout()) {
+            memcpy(static_cast<void*>(out), src, count * Size);
+            return;
+        }
+        for (size_t i = 0; i < count; ++i, src += Size) {
+            (Fields::template store<ByteOrder>(src, out[i]), ...);
+        }
+    }
+
+    // Struct of arrays: field by field, each column is written contiguously
+    static void decode(const char* src, size_t count, const Columns& columns) {
+        decodeColumns(src, count, columns, std::index_sequence_for<Fields...>());
+    }
+
+    // Columns moved on by n rows
+    static Columns advance(const Columns& columns, size_t n) {
+        return std::apply([n](auto*... column) { return Columns((column ? column + n : nullptr)...); }, columns);
+    }
+
+private:
+    template <size_t... I>
+    static void decodeColumns(const char* src, size_t count, const Columns& columns, std::index_sequence<I...>) {
+        (decodeColumn<Fields>(src, count, std::get<I>(columns)), ...);
+    }
+
+    template <typename Field>
+    static void decodeColumn(const char* src, size_t count, typename Field::Type* column) {
+        if (!column) return;
+        for (size_t i = 0; i < count; ++i, src += Size) {
+            column[i] = Field::template load<ByteOrder>(src);
+        }
+    }
+};
+
+// Builds a RecordLayout with the fields back to back in the order given, no padding
+template <typename R, std::endian ByteOrder, size_t Offset, typename FieldList, auto... Members>
+struct PackedRecordBuilder;
+
+template <typename R, std::endian ByteOrder, size_t Offset, typename... Fields>
+struct PackedRecordBuilder<R, ByteOrder, Offset, std::tuple<Fields...>> {
+    using type = RecordLayout<R, Offset, ByteOrder, Fields...>;
+};
+
+template <typename R, std::endian ByteOrder, size_t Offset, typename... Fields, auto First, auto... Rest>
+struct PackedRecordBuilder<R, ByteOrder, Offset, std::tuple<Fields...>, First, Rest...> {
+    using Field = RecordField<First, Offset>;
+    using type  = typename PackedRecordBuilder<R, ByteOrder, Offset + Field::size, std::tuple<Fields..., Field>, Rest...>::type;
+};
+
+template <typename R, std::endian ByteOrder, auto... Members>
+using PackedRecordLayout = typename PackedRecordBuilder<R, ByteOrder, 0, std::tuple<>, Members...>::type;
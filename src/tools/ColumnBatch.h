@@ -0,0 +1,175 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// A block of rows stored column by column: one contiguous, typed array per column and a
+// row count. Column storage is sized once up front, appending a row is a store per column.
+template <typename... Ts>
+class ColumnBatch {
+public:
+    static const size_t DEFAULT_ROWS = 65536;
+
+    static constexpr size_t numColumns = sizeof...(Ts);
+
+    template <size_t I>
+    using Type = std::tuple_element_t<I, std::tuple<Ts...>>;
+
+    ColumnBatch() = default;
+    explicit ColumnBatch(size_t capacity) { reserve(capacity); }
+
+    // A moved-from batch is left empty with no capacity
+    ColumnBatch(ColumnBatch&& other) noexcept :
+        m_columns(std::move(other.m_columns)),
+        m_rows(std::exchange(other.m_rows, 0)),
+        m_capacity(std::exchange(other.m_capacity, 0)) {
+    }
+    ColumnBatch& operator=(ColumnBatch&& other) noexcept {
+        m_columns  = std::move(other.m_columns);
+        m_rows     = std::exchange(other.m_rows, 0);
+        m_capacity = std::exchange(other.m_capacity, 0);
+        return *this;
+    }
+    ColumnBatch(const ColumnBatch&)            = default;
+    ColumnBatch& operator=(const ColumnBatch&) = default;
+
+    size_t rows()     const { return m_rows; }
+    size_t capacity() const { return m_capacity; }
+    bool   empty()    const { return m_rows == 0; }
+    bool   full()     const { return m_rows >= m_capacity; }
+
+    // rows() values, valid until the batch is cleared, reserved or its column taken
+    template <size_t I>
+    Type<I>* column() { return std::get<I>(m_columns).data(); }
+    template <size_t I>
+    const Type<I>* column() const { return std::get<I>(m_columns).data(); }
+
+    // Grows every column to hold capacity rows, never shrinks. Also restores a taken column.
+    void reserve(size_t capacity) {
+        std::apply([capacity](auto&... column) { ((column.size() < capacity ? column.resize(capacity) : void()), ...); }, m_columns);
+        m_capacity = std::max(m_capacity, capacity);
+    }
+
+    void push_back(const Ts&... values) {
+        assert(!full());
+        store(m_rows++, std::index_sequence_for<Ts...>(), values...);
+    }
+
+    void clear() { m_rows = 0; } // Keeps the storage for the next block
+
+    // Moves the column's storage out, trimmed to rows(), for handing on without a copy.
+    // The other columns are untouched, but the batch has no capacity (it is full()) until the
+    // next reserve(), which gives this column default values for the rows it already has.
+    template <size_t I>
+    std::vector<Type<I>> takeColumn() {
+        std::vector<Type<I>> ret = std::move(std::get<I>(m_columns));
+        ret.resize(m_rows);
+        std::get<I>(m_columns).clear();
+        m_capacity = 0;
+        return ret;
+    }
+
+private:
+    template <size_t... I>
+    void store(size_t row, std::index_sequence<I...>, const Ts&... values) {
+        ((std::get<I>(m_columns)[row] = values), ...);
+    }
+
+    std::tuple<std::vector<Ts>...> m_columns;
+    size_t                         m_rows     = 0;
+    size_t                         m_capacity = 0;
+};
+
+// Collects rows into ColumnBatches of batchRows rows. Each full batch is passed to onBatch, or
+// kept in batches() if there is none, so parsed data ends up in column blocks ready for
+// vectorized processing or handing to a component without copying.
+template <typename... Ts>
+class ColumnSink {
+public:
+    using Batch     = ColumnBatch<Ts...>;
+    using BatchFunc = std::function<void(Batch&&)>;
+
+    explicit ColumnSink(size_t batchRows = Batch::DEFAULT_ROWS, BatchFunc onBatch = BatchFunc()) :
+        m_batchRows(batchRows ? batchRows : Batch::DEFAULT_ROWS),
+        m_onBatch(std::move(onBatch)) {
+    }
+
+    void append(const Ts&... values) {
+        if (m_current.full()) {
+            emit();
+        }
+        m_current.push_back(values...);
+    }
+
+    // Passes on the partly filled batch, eg at the end of the input
+    void flush() {
+        if (!m_current.empty()) {
+            emit();
+        }
+    }
+
+    // Appends everything other collected, in order, after what this one has so far.
+    // The batch being filled here is flushed first, so a merge can leave one short batch behind.
+    void merge(ColumnSink&& other) {
+        flush();
+        other.flush();
+        for (auto& batch : other.m_batches) {
+            m_numRows += batch.rows();
+            if (m_onBatch) {
+                m_onBatch(std::move(batch));
+            }
+            else {
+                m_batches.push_back(std::move(batch));
+            }
+        }
+        other.m_batches.clear();
+        other.m_numRows = 0;
+    }
+
+    size_t              rows()    const { return m_numRows + m_current.rows(); }
+    std::vector<Batch>& batches()       { return m_batches; } // Full batches so far, see flush()
+
+private:
+    void emit() {
+        m_numRows += m_current.rows();
+        if (m_onBatch) {
+            m_onBatch(std::move(m_current));
+        }
+        else {
+            m_batches.push_back(std::move(m_current));
+        }
+
+        m_current = Batch(m_batchRows);
+    }
+
+    size_t             m_batchRows;
+    BatchFunc          m_onBatch;
+    Batch              m_current{ m_batchRows };
+    std::vector<Batch> m_batches;
+    size_t             m_numRows = 0; // Rows in batches already passed on
+};
@@ -0,0 +1,239 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "CpuTopology.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace fs = std::filesystem;
+
+CpuTopology::CpuTopology()
+{
+#if defined(__linux__)
+    // Every online node has a directory like /sys/devices/system/node/node1/ with a cpulist
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator("/sys/devices/system/node", ec)) {
+        const std::string name = entry.path().filename().string();
+        if (name.size() <= 4 || name.compare(0, 4, "node") != 0 ||
+            !std::all_of(name.begin() + 4, name.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            continue;
+        }
+
+        std::ifstream cpuList(entry.path() / "cpulist");
+        std::string   list;
+        if (cpuList && std::getline(cpuList, list)) {
+            Node node;
+            node.id   = std::stoi(name.substr(4));
+            node.cpus = parseCpuList(list);
+            if (!node.cpus.empty()) { // Memory-only nodes have no CPUs to run workers on
+                m_nodes.push_back(std::move(node));
+            }
+        }
+    }
+    std::sort(m_nodes.begin(), m_nodes.end(), [](const Node& a, const Node& b) { return a.id < b.id; });
+
+    // No NUMA support in the kernel, still try to get the exact online CPUs
+    if (m_nodes.empty()) {
+        std::ifstream online("/sys/devices/system/cpu/online");
+        std::string   list;
+        if (online && std::getline(online, list)) {
+            m_nodes.push_back(Node{ 0, parseCpuList(list) });
+        }
+    }
+#elif defined(_WIN32)
+    // Only covers the calling thread's processor group, which is all of it below 64 threads
+    ULONG highestNode = 0;
+    if (GetNumaHighestNodeNumber(&highestNode)) {
+        for (ULONG nodeId = 0; nodeId <= highestNode; ++nodeId) {
+            ULONGLONG mask = 0;
+            if (GetNumaNodeProcessorMask(UCHAR(nodeId), &mask) && mask) {
+                Node node;
+                node.id = int(nodeId);
+                for (unsigned cpu = 0; cpu < 64; ++cpu) {
+                    if (mask & (ULONGLONG(1) << cpu)) {
+                        node.cpus.push_back(cpu);
+                    }
+                }
+                m_nodes.push_back(std::move(node));
+            }
+        }
+    }
+#endif
+
+    if (m_nodes.empty()) {
+        Node node;
+        node.id = 0;
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+            node.cpus.push_back(cpu);
+        }
+        m_nodes.push_back(std::move(node));
+    }
+}
+
+const CpuTopology& CpuTopology::system()
+{
+    static CpuTopology topology;
+    return topology;
+}
+
+size_t CpuTopology::numCpus() const
+{
+    size_t ret = 0;
+    for (const auto& node : m_nodes) {
+        ret += node.cpus.size();
+    }
+    return ret;
+}
+
+int CpuTopology::nodeOfCpu(unsigned cpu) const
+{
+    for (const auto& node : m_nodes) {
+        if (std::find(node.cpus.begin(), node.cpus.end(), cpu) != node.cpus.end()) {
+            return node.id;
+        }
+    }
+    return -1;
+}
+
+int CpuTopology::nodeIndex(int nodeId) const
+{
+    for (size_t i = 0; i < m_nodes.size(); ++i) {
+        if (m_nodes[i].id == nodeId) {
+            return int(i);
+        }
+    }
+    return -1;
+}
+
+bool CpuTopology::pinCurrentThread(const std::vector<unsigned>& cpus)
+{
+    if (cpus.empty()) return false;
+
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    DWORD_PTR mask = 0;
+    for (unsigned cpu : cpus) {
+        if (cpu < sizeof(DWORD_PTR) * 8) {
+            mask |= DWORD_PTR(1) << cpu;
+        }
+    }
+    return mask && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+    return false;
+#endif
+}
+
+std::vector<unsigned> CpuTopology::allowedCpus()
+{
+    std::vector<unsigned> ret;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                ret.push_back(cpu);
+            }
+        }
+    }
+#elif defined(_WIN32)
+    DWORD_PTR processMask = 0;
+    DWORD_PTR systemMask  = 0;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+        for (unsigned cpu = 0; cpu < sizeof(DWORD_PTR) * 8; ++cpu) {
+            if (processMask & (DWORD_PTR(1) << cpu)) {
+                ret.push_back(cpu);
+            }
+        }
+    }
+#endif
+    return ret;
+}
+
+int CpuTopology::nodeOfAddress(const void* addr)
+{
+#if defined(__linux__) && defined(SYS_move_pages)
+    // move_pages with no target nodes only reports where each page lives
+    const uintptr_t pageSize = uintptr_t(sysconf(_SC_PAGESIZE));
+    void*           page     = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(addr) & ~(pageSize - 1));
+    int             status   = -1;
+    if (syscall(SYS_move_pages, 0, 1UL, &page, nullptr, &status, 0) == 0 && status >= 0) {
+        return status;
+    }
+#else
+    (void)addr;
+#endif
+    return -1;
+}
+
+std::vector<unsigned> CpuTopology::parseCpuList(const std::string& list)
+{
+    std::vector<unsigned> ret;
+
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+
+        const std::string range = list.substr(pos, end - pos);
+        const size_t      dash  = range.find('-');
+        try {
+            if (dash == std::string::npos) {
+                ret.push_back(unsigned(std::stoul(range)));
+            }
+            else {
+                const unsigned first = unsigned(std::stoul(range.substr(0, dash)));
+                const unsigned last  = unsigned(std::stoul(range.substr(dash + 1)));
+                for (unsigned cpu = first; cpu <= last; ++cpu) {
+                    ret.push_back(cpu);
+                }
+            }
+        }
+        catch (const std::exception&) {
+            // Trailing newline or garbage, skip it
+        }
+        pos = end + 1;
+    }
+    return ret;
+}
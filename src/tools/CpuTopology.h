@@ -0,0 +1,65 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include <string>
+#include <vector>
+
+// NUMA nodes and the CPUs that belong to them.
+// On Linux this is read from /sys/devices/system, so it needs nothing beyond the kernel.
+// Anywhere the topology can't be read, the machine is reported as a single node
+// holding every hardware thread, which makes all NUMA-aware code fall back gracefully.
+class CpuTopology
+{
+public:
+    struct Node {
+        int                   id;   // OS node number, can be sparse
+        std::vector<unsigned> cpus; // Logical CPU numbers
+    };
+
+    static const CpuTopology& system(); // Read once, on first use
+
+    const std::vector<Node>& nodes() const { return m_nodes; }
+    size_t numCpus() const;
+
+    int nodeOfCpu(unsigned cpu) const; // -1 if unknown
+    int nodeIndex(int nodeId) const;   // Position of the node in nodes(), -1 if unknown
+
+    // Restricts the calling thread to the given CPUs. Returns false if the OS refused.
+    static bool pinCurrentThread(const std::vector<unsigned>& cpus);
+
+    // CPUs the calling thread may run on (taskset, cgroup or container cpuset), which the threads
+    // it starts inherit. Ascending. Empty if the platform can't say, in which case any CPU may be.
+    static std::vector<unsigned> allowedCpus();
+
+    // Node that currently backs the page holding addr, -1 if it can't be determined
+    // (not yet touched, or unsupported platform). Useful to pick a submit node hint.
+    static int nodeOfAddress(const void* addr);
+
+    // Parses the kernel's cpulist format, eg "0-3,8-11"
+    static std::vector<unsigned> parseCpuList(const std::string& list);
+
+private:
+    CpuTopology();
+
+    std::vector<Node> m_nodes;
+};
@@ -0,0 +1,184 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "CsvScanner.h"
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CSV_SCANNER_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CSV_SCANNER_SSE2 1
+#endif
+
+namespace {
+    inline bool isStructural(char c, char delim) {
+        return c == delim || c == '\n' || c == '\r';
+    }
+
+#if CSV_SCANNER_AVX2
+    const size_t BlockSize = 32;
+
+    struct Matcher {
+        __m256i delim, cr, lf;
+
+        explicit Matcher(char d) :
+            delim(_mm256_set1_epi8(d)),
+            cr(_mm256_set1_epi8('\r')),
+            lf(_mm256_set1_epi8('\n')) {
+        }
+
+        // Bit i is set if byte i of the block is structural
+        uint32_t match(const char* block) const {
+            const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+            const __m256i hits  = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, delim),
+                                                                  _mm256_cmpeq_epi8(bytes, cr)),
+                                                  _mm256_cmpeq_epi8(bytes, lf));
+            return uint32_t(_mm256_movemask_epi8(hits));
+        }
+    };
+#elif CSV_SCANNER_SSE2
+    const size_t BlockSize = 16;
+
+    struct Matcher {
+        __m128i delim, cr, lf;
+
+        explicit Matcher(char d) :
+            delim(_mm_set1_epi8(d)),
+            cr(_mm_set1_epi8('\r')),
+            lf(_mm_set1_epi8('\n')) {
+        }
+
+        uint32_t match(const char* block) const {
+            const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+            const __m128i hits  = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, delim),
+                                                            _mm_cmpeq_epi8(bytes, cr)),
+                                               _mm_cmpeq_epi8(bytes, lf));
+            return uint32_t(_mm_movemask_epi8(hits));
+        }
+    };
+#else
+    const size_t BlockSize = 8;
+
+    // SWAR fallback, 8 bytes per step with plain integer math
+    struct Matcher {
+        uint64_t delim, cr, lf;
+
+        explicit Matcher(char d) :
+            delim(broadcast(d)),
+            cr(broadcast('\r')),
+            lf(broadcast('\n')) {
+        }
+
+        static uint64_t broadcast(char c) { return uint64_t(uint8_t(c)) * 0x0101010101010101ull; }
+
+        // High bit of each byte set where the byte is zero. Exact, no false positives.
+        static uint64_t zeroBytes(uint64_t v) {
+            const uint64_t low7 = 0x7F7F7F7F7F7F7F7Full;
+            return ~(((v & low7) + low7) | v | low7);
+        }
+
+        uint32_t match(const char* block) const {
+            uint64_t bytes = 0;
+            if constexpr (std::endian::native == std::endian::little) {
+                std::memcpy(&bytes, block, sizeof(bytes));
+            }
+            else {
+                for (size_t i = 0; i < 8; ++i) {
+                    bytes |= uint64_t(uint8_t(block[i])) << (8 * i); // Byte i in bits 8i..8i+7, as on little endian
+                }
+            }
+            const uint64_t hits = zeroBytes(bytes ^ delim) | zeroBytes(bytes ^ cr) | zeroBytes(bytes ^ lf);
+
+            // Gather the high bit of every byte into the low 8 bits
+            uint32_t ret = 0;
+            for (size_t i = 0; i < 8; ++i) {
+                ret |= uint32_t((hits >> (8 * i + 7)) & 1) << i;
+            }
+            return ret;
+        }
+    };
+#endif
+}
+
+size_t CsvScanner::findStructural(std::string_view text, char delim) {
+    const char*  data = text.data();
+    const size_t size = text.size();
+    size_t       i    = 0;
+
+    const Matcher matcher(delim);
+    for (; i + BlockSize <= size; i += BlockSize) {
+        if (const uint32_t mask = matcher.match(data + i)) {
+            return i + size_t(std::countr_zero(mask));
+        }
+    }
+
+    for (; i < size; ++i) {
+        if (isStructural(data[i], delim)) {
+            return i;
+        }
+    }
+    return size;
+}
+
+void CsvScanner::splitFields(std::string_view record, std::vector<std::string_view>& fields, char delim) {
+    fields.clear();
+
+    // One pass over the whole record. Only the delimiter can be left in a record, so every
+    // structural character found ends a field.
+    const char*  data  = record.data();
+    const size_t size  = record.size();
+    size_t       start = 0;
+    size_t       i     = 0;
+
+    const Matcher matcher(delim);
+    for (; i + BlockSize <= size; i += BlockSize) {
+        uint32_t mask = matcher.match(data + i);
+        while (mask) {
+            const size_t end = i + size_t(std::countr_zero(mask));
+            fields.push_back(record.substr(start, end - start));
+            start = end + 1;
+            mask &= mask - 1; // Clear the lowest set bit
+        }
+    }
+
+    for (; i < size; ++i) {
+        if (isStructural(data[i], delim)) {
+            fields.push_back(record.substr(start, i - start));
+            start = i + 1;
+        }
+    }
+    fields.push_back(record.substr(start));
+}
+
+const char* CsvScanner::implementation() {
+#if CSV_SCANNER_AVX2
+    return "avx2";
+#elif CSV_SCANNER_SSE2
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
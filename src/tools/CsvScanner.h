@@ -0,0 +1,53 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include <charconv>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+// Finds the structural characters of comma separated text: the delimiter, '\r' and '\n'.
+// Scans 32 bytes per step with AVX2, 16 with SSE2, otherwise 8 at a time with plain integer
+// math. The instruction set is chosen at compile time only, there is no runtime CPU check:
+// a build with /arch:AVX2 (or -mavx2), which is what ours target, faults on a host without AVX2.
+class CsvScanner {
+public:
+    // Offset of the first structural character in text, or text.size() if there is none
+    static size_t findStructural(std::string_view text, char delim = ',');
+
+    // Splits one record (no line ending) into its fields, replacing the contents of fields
+    static void splitFields(std::string_view record, std::vector<std::string_view>& fields, char delim = ',');
+
+    // Whole field as a number, surrounding spaces and a leading '+' allowed. Returns false if it isn't one.
+    template <typename T>
+    static bool toNumber(std::string_view field, T& value) {
+        while (!field.empty() && (field.front() == ' ' || field.front() == '\t')) field.remove_prefix(1);
+        while (!field.empty() && (field.back()  == ' ' || field.back()  == '\t')) field.remove_suffix(1);
+        if (!field.empty() && field.front() == '+') field.remove_prefix(1);
+
+        const auto result = std::from_chars(field.data(), field.data() + field.size(), value);
+        return result.ec == std::errc() && result.ptr == field.data() + field.size();
+    }
+
+    static const char* implementation(); // "avx2", "sse2" or "scalar"
+};
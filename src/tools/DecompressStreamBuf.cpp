@@ -0,0 +1,377 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "DecompressStreamBuf.h"
+#include "RawFile.h"
+#include "Threadpool.h"
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef FLOCORE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef FLOCORE_ZSTD
+#include <zstd.h>
+#endif
+
+// Produces the file's decompressed contents a piece at a time
+struct DecompressStreamBuf::Decoder {
+    virtual ~Decoder() = default;
+
+    // Next piece of output, valid until the following call. Empty once everything has been returned.
+    virtual std::string_view next() = 0;
+};
+
+#ifdef FLOCORE_ZLIB
+// gzip and zlib both, including gzip files of several members back to back
+class DecompressStreamBuf::ZlibDecoder : public DecompressStreamBuf::Decoder {
+public:
+    ZlibDecoder(std::string_view input, size_t blockSize) : m_input(input), m_out(blockSize) {
+        memset(&m_stream, 0, sizeof(m_stream));
+        if (inflateInit2(&m_stream, 15 + 32) != Z_OK) { // +32 detects the gzip or zlib header by itself
+            throw std::runtime_error("inflateInit2 failed");
+        }
+    }
+    ~ZlibDecoder() override { inflateEnd(&m_stream); }
+
+    std::string_view next() override {
+        m_stream.next_out  = reinterpret_cast<Bytef*>(m_out.data());
+        m_stream.avail_out = uInt(m_out.size());
+
+        while (m_stream.avail_out > 0 && !m_finished) {
+            if (m_stream.avail_in == 0) {
+                if (m_input.empty()) {
+                    if (m_stream.avail_out < m_out.size()) break; // Hand over what there is, throw next time
+                    throw std::runtime_error("Compressed file is truncated");
+                }
+                const size_t length = std::min<size_t>(m_input.size(), UINT_MAX);
+                m_stream.next_in    = reinterpret_cast<Bytef*>(const_cast<char*>(m_input.data()));
+                m_stream.avail_in   = uInt(length);
+                m_input.remove_prefix(length);
+            }
+
+            const int ret = inflate(&m_stream, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                // Another gzip member may follow, anything else after the end is ignored
+                const std::string_view rest(reinterpret_cast<const char*>(m_stream.next_in), m_stream.avail_in);
+                const bool             more = (m_stream.avail_in > 0) ? hasHeader(Format::Gzip, rest)
+                                                                      : hasHeader(Format::Gzip, m_input);
+                if (more) {
+                    inflateReset(&m_stream);
+                }
+                else {
+                    m_finished = true;
+                }
+            }
+            else if (ret != Z_OK && !(ret == Z_BUF_ERROR && m_stream.avail_in == 0)) {
+                throw std::runtime_error(std::string("Decompression failed: ") + (m_stream.msg ? m_stream.msg : "corrupt input"));
+            }
+        }
+        return std::string_view(m_out.data(), m_out.size() - m_stream.avail_out);
+    }
+
+private:
+    z_stream          m_stream;
+    std::string_view  m_input;    // Not yet handed to inflate
+    std::vector<char> m_out;
+    bool              m_finished = false;
+};
+#endif
+
+#ifdef FLOCORE_ZSTD
+namespace {
+    struct ZstdContext {
+        ZstdContext() : dctx(ZSTD_createDCtx()) {
+            if (!dctx) throw std::bad_alloc();
+        }
+        ~ZstdContext() { ZSTD_freeDCtx(dctx); }
+        ZstdContext(const ZstdContext&)            = delete;
+        ZstdContext& operator=(const ZstdContext&) = delete;
+
+        ZSTD_DCtx* dctx;
+    };
+
+    // Most a frame may claim to inflate by and still be decompressed whole. The size comes from
+    // the file, so a corrupt one could otherwise ask for any amount of memory up front.
+    const uint64_t MAX_FRAME_RATIO = 1024;
+
+    void checkZstd(size_t result) {
+        if (ZSTD_isError(result)) {
+            throw std::runtime_error(std::string("Decompression failed: ") + ZSTD_getErrorName(result));
+        }
+    }
+}
+
+// One frame, or frames whose decompressed size isn't recorded, decoded in order on the reading thread
+class DecompressStreamBuf::ZstdStreamDecoder : public DecompressStreamBuf::Decoder {
+public:
+    ZstdStreamDecoder(std::string_view input, size_t blockSize) : m_out(blockSize) {
+        m_in = ZSTD_inBuffer{ input.data(), input.size(), 0 };
+    }
+
+    std::string_view next() override {
+        ZSTD_outBuffer out = { m_out.data(), m_out.size(), 0 };
+        while (out.pos < out.size) {
+            if (m_in.pos == m_in.size && m_lastResult == 0) break; // Every frame is complete
+
+            const size_t outBefore = out.pos;
+            const size_t inBefore  = m_in.pos;
+            m_lastResult = ZSTD_decompressStream(m_context.dctx, &out, &m_in);
+            checkZstd(m_lastResult);
+            if (out.pos == outBefore && m_in.pos == inBefore) {
+                if (out.pos > 0) break; // Hand over what there is, throw next time
+                throw std::runtime_error("Compressed file is truncated");
+            }
+        }
+        return std::string_view(m_out.data(), out.pos);
+    }
+
+private:
+    ZstdContext       m_context;
+    ZSTD_inBuffer     m_in;
+    std::vector<char> m_out;
+    size_t            m_lastResult = 0;
+};
+
+// Several frames of known size, each decompressed in one go by a task on the compute pool
+class DecompressStreamBuf::ZstdFrameDecoder : public DecompressStreamBuf::Decoder {
+public:
+    struct Frame {
+        std::string_view input;
+        size_t           size; // Decompressed
+    };
+
+    ZstdFrameDecoder(std::vector<Frame> frames, size_t framesAhead) : m_frames(std::move(frames)), m_slots(std::max<size_t>(framesAhead, 1)) {
+        for (auto& slot : m_slots) {
+            schedule(slot);
+        }
+    }
+
+    ~ZstdFrameDecoder() override {
+        for (auto& slot : m_slots) {
+            if (slot.done.valid()) {
+                try {
+                    Threadpool::join(std::move(slot.done)); // Helps rather than blocks, the compute pool can have no workers
+                }
+                catch (...) {
+                    // Nobody will read the output, nor hear what went wrong making it
+                }
+            }
+        }
+    }
+
+    std::string_view next() override {
+        // An empty frame is legal, but an empty view would end the stream, so those are passed over
+        while (true) {
+            // The reader is done with the previous frame, its slot can start on another
+            if (m_current > 0) {
+                schedule(m_slots[(m_current - 1) % m_slots.size()]);
+            }
+            if (m_current == m_frames.size()) {
+                return std::string_view();
+            }
+
+            Slot& slot = m_slots[m_current % m_slots.size()];
+            Threadpool::join(std::move(slot.done)); // Rethrows a corrupt frame
+            m_current++;
+
+            if (!slot.output.empty()) {
+                return std::string_view(slot.output.data(), slot.output.size());
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        ZstdContext          context;
+        std::vector<char>    output;
+        Threadpool::Waitable done;
+    };
+
+    void schedule(Slot& slot) {
+        if (m_scheduled == m_frames.size()) return;
+
+        const Frame& frame = m_frames[m_scheduled++];
+        slot.done = Threadpool::submit([&slot, &frame]() {
+            slot.output.resize(frame.size);
+            const size_t result = ZSTD_decompressDCtx(slot.context.dctx, slot.output.data(), slot.output.size(), frame.input.data(), frame.input.size());
+            checkZstd(result);
+            slot.output.resize(result);
+        });
+    }
+
+    std::vector<Frame> m_frames;
+    std::vector<Slot>  m_slots;
+    size_t             m_scheduled = 0; // Frames handed to a slot
+    size_t             m_current   = 0; // Next frame to return
+};
+#endif
+
+DecompressStreamBuf::DecompressStreamBuf() = default;
+
+DecompressStreamBuf::~DecompressStreamBuf() {
+    close();
+}
+
+DecompressStreamBuf::Format DecompressStreamBuf::formatOf(const fs::path& filePath) {
+    std::string extension = filePath.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+
+    if (extension == ".gz" || extension == ".gzip") return Format::Gzip;
+    if (extension == ".zst" || extension == ".zstd") return Format::Zstd;
+    if (extension == ".zz" || extension == ".zlib") return Format::Zlib;
+    return Format::Plain;
+}
+
+bool DecompressStreamBuf::hasHeader(Format format, std::string_view contents) {
+    const auto byte = [&contents](size_t i) { return static_cast<unsigned char>(contents[i]); };
+
+    switch (format) {
+    case Format::Zstd:
+        return contents.size() >= 4 && byte(0) == 0x28 && byte(1) == 0xB5 && byte(2) == 0x2F && byte(3) == 0xFD;
+    case Format::Gzip:
+        return contents.size() >= 3 && byte(0) == 0x1F && byte(1) == 0x8B && byte(2) == 8; // Deflate, the only method there is
+    case Format::Zlib:
+        // The whole two byte header: deflate, a window of 32K or less, no preset dictionary
+        // (nothing here could supply it) and the check bits that make it a multiple of 31
+        return contents.size() >= 2 && (byte(0) & 0x0F) == 8 && (byte(0) >> 4) <= 7 && (byte(1) & 0x20) == 0 &&
+               ((unsigned(byte(0)) << 8) | byte(1)) % 31 == 0;
+    default:
+        return true;
+    }
+}
+
+bool DecompressStreamBuf::isSupported(Format format) {
+    switch (format) {
+#ifdef FLOCORE_ZLIB
+    case Format::Gzip:
+    case Format::Zlib:
+        return true;
+#endif
+#ifdef FLOCORE_ZSTD
+    case Format::Zstd:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+bool DecompressStreamBuf::open(const fs::path& filePath, const Options& options) {
+    close();
+
+    const Format format = formatOf(filePath);
+    if (format == Format::Plain) {
+        throw std::runtime_error(filePath.string() + ": not named as a compressed file (.gz, .zst, .zz)");
+    }
+    if (!isSupported(format)) {
+        throw std::runtime_error(filePath.string() + ": reading " + (format == Format::Zstd ? "zstd" : "gzip/zlib") +
+                                 " input needs a build with " + (format == Format::Zstd ? "zstd=on" : "zlib=on"));
+    }
+    if (!m_input.open(filePath)) return false;
+
+    // Compressed input is read once, front to back
+    m_input.advise(MappedFile::Access::Sequential);
+    const std::string_view input = m_input.view();
+    [[maybe_unused]] const size_t blockSize = std::max<size_t>(options.blockSize, 4096); // Unused with no decompressors built in
+
+    if (!hasHeader(format, input)) {
+        close();
+        throw std::runtime_error(filePath.string() + ": contents don't match the compressed format its name gives");
+    }
+
+    m_format = format;
+    switch (m_format) {
+#ifdef FLOCORE_ZLIB
+    case Format::Gzip:
+    case Format::Zlib:
+        m_decoder = std::make_unique<ZlibDecoder>(input, blockSize);
+        break;
+#endif
+#ifdef FLOCORE_ZSTD
+    case Format::Zstd: {
+        // Frames can only be split among tasks if each one records how big it inflates to, and
+        // that is small enough to allocate up front. Otherwise the whole file is streamed.
+        std::vector<ZstdFrameDecoder::Frame> frames;
+        std::string_view                     rest     = input;
+        bool                                 parallel = true;
+        while (!rest.empty() && parallel) {
+            const size_t             frameSize   = ZSTD_findFrameCompressedSize(rest.data(), rest.size());
+            const unsigned long long contentSize = ZSTD_getFrameContentSize(rest.data(), rest.size());
+            if (ZSTD_isError(frameSize) || contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR ||
+                contentSize > options.maxFrameSize || contentSize / MAX_FRAME_RATIO > frameSize) {
+                parallel = false;
+                break;
+            }
+            frames.push_back(ZstdFrameDecoder::Frame{ rest.substr(0, frameSize), size_t(contentSize) });
+            rest.remove_prefix(frameSize);
+        }
+
+        if (parallel && frames.size() > 1) {
+            m_decoder = std::make_unique<ZstdFrameDecoder>(std::move(frames), options.framesAhead);
+        }
+        else {
+            m_decoder = std::make_unique<ZstdStreamDecoder>(input, blockSize);
+        }
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+
+    if (!m_decoder) {
+        close();
+        return false;
+    }
+    setg(nullptr, nullptr, nullptr);
+    return true;
+}
+
+void DecompressStreamBuf::close() {
+    m_decoder.reset(); // Waits for any frames still being decompressed into it
+    m_input.close();
+    m_format = Format::Plain;
+    setg(nullptr, nullptr, nullptr);
+}
+
+DecompressStreamBuf::int_type DecompressStreamBuf::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    if (!m_decoder) {
+        return traits_type::eof();
+    }
+
+    const std::string_view piece = m_decoder->next();
+    if (piece.empty()) {
+        setg(nullptr, nullptr, nullptr);
+        return traits_type::eof();
+    }
+
+    char* data = const_cast<char*>(piece.data());
+    setg(data, data, data + piece.size());
+    return traits_type::to_int_type(*gptr());
+}
@@ -0,0 +1,82 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include "VfCommon.h"
+#include "MappedFile.h"
+
+#include <streambuf>
+#include <string_view>
+
+// Read-only stream buffer over a compressed file, decompressing into memory as the parser reads
+// so the uncompressed data never goes to disk. Only files named as compressed are taken as such:
+// .gz, .zst and .zz (zlib), whose header must then match. The contents of any other file are never
+// sniffed, a binary record or text file can start with anything.
+// gzip and zlib need FLOCORE_ZLIB, zstd needs FLOCORE_ZSTD (scons zlib=on / zstd=on).
+// A zstd file made of several frames (pzstd, or frames written separately and concatenated)
+// is decompressed a frame per task on the compute pool, framesAhead frames ahead of the reader.
+// There is no seeking, only a forward read.
+class DecompressStreamBuf : public std::streambuf {
+public:
+    enum class Format { Plain,
+                        Gzip,
+                        Zlib,
+                        Zstd };
+
+    struct Options {
+        size_t blockSize    = 4 << 20;  // Output decompressed per underflow() when streaming
+        size_t framesAhead  = 8;        // zstd frames in flight at once, memory use is this many frames
+        size_t maxFrameSize = 64 << 20; // Largest zstd frame decompressed whole, a file with larger ones is streamed
+    };
+
+    DecompressStreamBuf();
+    ~DecompressStreamBuf() override;
+
+    DecompressStreamBuf(const DecompressStreamBuf&)            = delete;
+    DecompressStreamBuf& operator=(const DecompressStreamBuf&) = delete;
+
+    static Format formatOf(const fs::path& filePath);                // From the extension, Plain for anything else
+    static bool   hasHeader(Format format, std::string_view contents); // The file starts like one in that format
+    static bool   isSupported(Format format);                         // Compiled in
+
+    // False if the file can't be opened. Throws std::runtime_error if its name says it is compressed
+    // but its header disagrees, or support for the format isn't built in.
+    bool open(const fs::path& filePath, const Options& options);
+    bool open(const fs::path& filePath) { return open(filePath, Options()); }
+    void close();
+
+    bool   is_open() const { return m_decoder != nullptr; }
+    Format format()  const { return m_format; }
+
+protected:
+    int_type underflow() override; // Throws on corrupt or truncated input, which the istream turns into badbit
+
+private:
+    struct Decoder;
+    class  ZlibDecoder;
+    class  ZstdStreamDecoder;
+    class  ZstdFrameDecoder;
+
+    MappedFile               m_input;
+    Format                   m_format = Format::Plain;
+    std::unique_ptr<Decoder> m_decoder;
+};
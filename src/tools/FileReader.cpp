@@ -23,13 +23,47 @@
 
 #include <cassert>
 
-FileReader::FileReader(const fs::path& filePath) :
+FileReader::FileReader(const fs::path& filePath, Backend backend, const PrefetchStreamBuf::Options& streamOptions) :
     m_fileBuf(),
-    m_stringBuf(),
-    m_fs(nullptr)
+    m_viewBuf(),
+    m_prefetchBuf(),
+    m_decompressBuf(),
+    m_fs(nullptr),
+    m_path(filePath)
 {
     if (!filePath.empty() && (filePath.string().size() <= _MAX_PATH))
     {
+        // Compressed input (going by the name, see DecompressStreamBuf) is inflated as it is read,
+        // never to disk. Throws if support for the format isn't built in, or the contents don't
+        // match the name, rather than parsing compressed bytes as text.
+        if (DecompressStreamBuf::formatOf(filePath) != DecompressStreamBuf::Format::Plain) {
+            if (m_decompressBuf.open(filePath)) {
+                m_fs.rdbuf(&m_decompressBuf);
+            }
+            return;
+        }
+
+        // Mapping works for any file size, and pages are only read as the parse reaches them
+        if (backend == Backend::Mapped && m_map.open(filePath)) {
+            m_map.advise(MappedFile::Access::Sequential);
+            if (m_map.size() < LARGE_FILE_SIZE) {
+                m_map.advise(MappedFile::Access::WillNeed); // Small enough to start reading it all in right away
+            }
+
+            m_viewBuf.reset(m_map.view());
+            m_fs.rdbuf(&m_viewBuf);
+            return;
+        }
+
+        if (backend == Backend::Streaming || backend == Backend::Direct) {
+            PrefetchStreamBuf::Options options = streamOptions;
+            options.bypassCache |= (backend == Backend::Direct);
+            if (m_prefetchBuf.open(filePath, options)) {
+                m_fs.rdbuf(&m_prefetchBuf);
+            }
+            return;
+        }
+
         // Try to open file
         m_fileBuf.open(filePath, std::fstream::in | std::fstream::binary);
 
@@ -49,13 +83,18 @@ FileReader::FileReader(const fs::path& filePath) :
                 m_buf.resize(fileSize);
                 m_fs.read(m_buf.data(), fileSize);
 
-//                m_stringBuf.pubsetbuf(m_buf.data(), m_buf.size());
-                m_stringBuf.str(m_buf);
+                // Parse straight out of m_buf rather than copying it into a stringbuf
+                m_viewBuf.reset(m_buf);
 
-                m_fs.rdbuf(&m_stringBuf);
+                m_fs.rdbuf(&m_viewBuf);
                 m_fs.seekg(0, std::fstream::beg);
                 m_fileBuf.close();
             }
+            else if (fileSize >= LARGE_FILE_SIZE && m_prefetchBuf.open(filePath, streamOptions)) {
+                // Too big to hold, read it ahead of the parse instead
+                m_fs.rdbuf(&m_prefetchBuf);
+                m_fileBuf.close();
+            }
 
             assert(m_fs);
         }
@@ -72,15 +111,148 @@ FileReader& FileReader::getc(char& c) {
 }
 
 FileReader& FileReader::getline(std::string& line) {
-    std::getline(m_fs, line);
+    if (!inMemory()) {
+        std::getline(m_fs, line);
+        return *this;
+    }
+
+    // Same result and stream state as std::getline, but a memchr and one copy into line
+    line.clear();
+    if (!m_fs.good()) {
+        m_fs.setstate(std::ios_base::failbit);
+        return *this;
+    }
+
+    const std::string_view rest = m_viewBuf.remaining();
+    if (rest.empty()) {
+        m_fs.setstate(std::ios_base::eofbit | std::ios_base::failbit);
+        return *this;
+    }
+
+    const size_t len = rest.find('\n');
+    if (len == std::string_view::npos) {
+        line.assign(rest.data(), rest.size());
+        m_viewBuf.advance(rest.size());
+        m_fs.setstate(std::ios_base::eofbit);
+    }
+    else {
+        line.assign(rest.data(), len);
+        m_viewBuf.advance(len + 1);
+    }
     return *this;
 }
 
 FileReader& FileReader::ignore(const size_t n, const int delim) {
-    m_fs.ignore(n, delim);
+    if (!inMemory()) {
+        m_fs.ignore(n, delim);
+        return *this;
+    }
+
+    if (!m_fs.good()) {
+        m_fs.setstate(std::ios_base::failbit);
+        return *this;
+    }
+
+    const std::string_view rest  = m_viewBuf.remaining();
+    size_t                 count = std::min(n, rest.size());
+    bool                   found = false;
+    if (delim >= 0 && delim <= 0xFF) {
+        const size_t pos = rest.substr(0, count).find(char(delim));
+        if (pos != std::string_view::npos) {
+            count = pos + 1; // The delimiter is extracted too
+            found = true;
+        }
+    }
+    m_viewBuf.advance(count);
+
+    // Like istream::ignore, running out of input before n chars or the delimiter is eof
+    if (!found && count < n) {
+        m_fs.setstate(std::ios_base::eofbit);
+    }
+    return *this;
+}
+
+FileReader& FileReader::parseField(std::string& data) {
+    if (!m_fs.good()) {
+        m_fs.setstate(std::ios_base::failbit);
+        return *this;
+    }
+
+    const std::string_view rest = m_viewBuf.remaining();
+    const size_t           len  = CsvScanner::findStructural(rest);
+    if (len == rest.size()) {
+        // Last field of the file, the char by char version fails its final get() here too
+        data.append(rest.data(), rest.size());
+        m_viewBuf.advance(rest.size());
+        m_fs.setstate(std::ios_base::eofbit | std::ios_base::failbit);
+    }
+    else {
+        data.append(rest.data(), len);
+        m_viewBuf.advance(len + 1);
+    }
     return *this;
 }
 
+std::vector<std::string_view> FileReader::splitChunks(std::string_view text, size_t numChunks, size_t minChunkSize) {
+    std::vector<std::string_view> ret;
+
+    const size_t chunkSize = std::max(text.size() / std::max<size_t>(numChunks, 1), std::max<size_t>(minChunkSize, 1));
+    while (!text.empty()) {
+        size_t len = std::min(chunkSize, text.size());
+
+        // Extend to the end of the line the cut landed in
+        if (len < text.size()) {
+            const size_t newline = text.find('\n', len - 1);
+            len = (newline == std::string_view::npos) ? text.size() : newline + 1;
+        }
+        ret.push_back(text.substr(0, len));
+        text.remove_prefix(len);
+    }
+    return ret;
+}
+
+bool FileReader::seekToRecord(uint64_t record) {
+    const RecordIndex& index = recordIndex();
+
+    uint64_t offset, toSkip;
+    if (!m_fs.rdbuf() || !index.locate(record, offset, toSkip)) {
+        m_fs.setstate(std::ios_base::failbit);
+        return false;
+    }
+
+    m_fs.clear();
+    m_fs.seekg(std::streamoff(offset));
+    for (; toSkip > 0 && m_fs; --toSkip) {
+        ignore(size_t(std::numeric_limits<std::streamsize>::max()), '\n');
+    }
+    return bool(m_fs);
+}
+
+const RecordIndex& FileReader::recordIndex(uint64_t stride) {
+    // The index holds offsets into the file, which mean nothing in the decompressed stream
+    if (m_recordIndex.empty() && !m_path.empty() && !compressed()) {
+        m_recordIndex.loadOrBuild(m_path, stride);
+    }
+    return m_recordIndex;
+}
+
+std::string_view FileReader::view() const {
+    return inMemory() ? m_viewBuf.view() : std::string_view();
+}
+
+std::string_view FileReader::remaining() const {
+    return inMemory() ? m_viewBuf.remaining() : std::string_view();
+}
+
+void FileReader::skip(size_t n) {
+    if (inMemory()) {
+        m_viewBuf.advance(std::min(n, m_viewBuf.remaining().size()));
+    }
+    else {
+        m_fs.ignore(std::streamsize(n));
+    }
+}
+
 bool FileReader::eof() const {
     return m_fs.eof();
 }
@@ -92,5 +264,9 @@ bool FileReader::readable() const {
 void FileReader::close() {
     if (m_fileBuf.is_open()) { m_fileBuf.close(); }
     m_fs.rdbuf(nullptr);
+    m_viewBuf.reset(std::string_view());
+    m_prefetchBuf.close();
+    m_decompressBuf.close();
+    m_map.close();
     m_buf.clear();
 }
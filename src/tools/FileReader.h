@@ -22,22 +22,59 @@
 #pragma once
 
 #include "VfCommon.h"
+#include "BinaryRecord.h"
+#include "CsvScanner.h"
+#include "DecompressStreamBuf.h"
+#include "MappedFile.h"
+#include "PrefetchStreamBuf.h"
+#include "RecordIndex.h"
+#include "Threadpool.h"
+#include "ViewStreamBuf.h"
 
+#include <cctype>
+#include <charconv>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <limits>
+#include <string_view>
+#include <type_traits>
 
 class FileReader {
 public:
+    // Mapped:   the file is memory mapped and parsed in place, nothing is copied. Falls back
+    //           to Buffered if the file can't be mapped (eg a pipe).
+    // Buffered:  files below LARGE_FILE_SIZE are read into memory up front, larger ones
+    //            are streamed like Streaming.
+    // Streaming: the file is read in blocks on the I/O pool, ahead of the parse, so reading
+    //            and parsing overlap. Memory use is bounded by streamOptions whatever the file size.
+    // Direct:    Streaming, around the page cache (see PrefetchStreamBuf::Options::bypassCache),
+    //            for huge one-pass inputs that would otherwise push out data that gets reused.
+    // Files named .gz, .zst or .zz are decompressed in memory as they are parsed, whatever the
+    // backend, and the constructor throws if that support isn't built in. The contents of other
+    // files are never inspected. See DecompressStreamBuf.
+    enum class Backend { Mapped,
+                         Buffered,
+                         Streaming,
+                         Direct };
+
     virtual bool readAndParse() = 0;
 
-    explicit FileReader(const std::filesystem::path& filePath);
+    explicit FileReader(const std::filesystem::path& filePath, Backend backend = Backend::Mapped,
+                        const PrefetchStreamBuf::Options& streamOptions = PrefetchStreamBuf::Options());
 
     virtual ~FileReader();
 
     explicit operator bool() const { return bool(m_fs); }
     bool operator!() const { return !m_fs; }
 
+    // Moves to the start of record (line) n, counting from 0 with any header line as record 0,
+    // eg to resume a job where it failed. The file's RecordIndex is loaded from its sidecar, or
+    // built and saved, the first time. Returns false and fails the stream if there is no record n,
+    // or the file is compressed.
+    bool seekToRecord(uint64_t record);
+    const RecordIndex& recordIndex(uint64_t stride = RecordIndex::DEFAULT_STRIDE); // Loads or builds it if needed
+
 protected:
     static const size_t LARGE_FILE_SIZE = 1073741824; // 1GB
     using ReadMode = enum { ReadModeAscii,
@@ -54,10 +91,23 @@ protected:
     FileReader& ignore(const size_t n, const int delim = -1);
     char        peek() { return m_fs.peek(); }
 
+    // Direct access to the file contents when they are in memory (mapped or buffered), empty otherwise.
+    // Code that consumes from remaining() itself moves the read position along with skip().
+    std::string_view view() const;
+    std::string_view remaining() const;
+    void             skip(size_t n);
+    bool             inMemory() const { return m_fs.rdbuf() == &m_viewBuf; }
+    bool             compressed() const { return m_decompressBuf.is_open(); }
+
     // Generic Parse Data Formats
     template <ReadMode M, typename T>
     FileReader& parse(T& data) {
         if constexpr (M == ReadModeAscii) {
+            if constexpr (usesFromChars<T>()) {
+                if (inMemory()) {
+                    return parseNumber(data);
+                }
+            }
             m_fs >> data;
             m_fs.ignore(1, ',');
         } else {
@@ -69,6 +119,10 @@ protected:
     // Need special case for string because comma separated values count as one value using the >> operator
     template<>
     FileReader& parse<ReadModeAscii, std::string>(std::string& data) {
+        if (inMemory()) {
+            return parseField(data);
+        }
+
         char c;
         bool delim = false;
         while(!delim && m_fs.get(c)) {
@@ -96,12 +150,233 @@ protected:
 
         return *this;
     }
+
+    // Fixed-size binary records described by a RecordLayout (see BinaryRecord.h), in bulk rather than
+    // one read() per field. Both return how many whole records were read; running out of file part
+    // way sets fail and eof like read() does. In memory the records are decoded straight from the
+    // file, otherwise through one read() per batch of RECORD_BATCH_SIZE bytes.
+    template <typename Layout>
+    size_t readRecords(typename Layout::Record* out, size_t count) {
+        if (Layout::isMemoryLayout() && !inMemory()) {
+            m_fs.read(reinterpret_cast<char*>(out), std::streamsize(count * Layout::size));
+            return size_t(m_fs.gcount()) / Layout::size;
+        }
+        return readRecordBatches<Layout>(count, [out](const char* src, size_t first, size_t n) { Layout::decode(src, n, out + first); });
+    }
+
+    template <typename Layout>
+    size_t readRecords(const typename Layout::Columns& columns, size_t count) {
+        return readRecordBatches<Layout>(count, [&columns](const char* src, size_t first, size_t n) {
+            Layout::decode(src, n, Layout::advance(columns, first));
+        });
+    }
+
+    static const size_t RECORD_BATCH_SIZE = 1048576; // 1MB
+
+    // Parallel parse of the rest of the file, one line per record ('\r\n' endings are trimmed).
+    // The file is cut into chunks at line boundaries and every chunk is parsed on the compute pool
+    // into its own State with onRecord(State&, std::string_view record). merge(State&&) is then
+    // called on this thread with each chunk's State, in file order. onRecord must only touch the
+    // State it is given. Exceptions from either are rethrown here.
+    // If the file isn't in memory it is all parsed on this thread, as a single chunk.
+    template <typename State, typename OnRecord, typename Merge>
+    bool parseChunked(OnRecord&& onRecord, Merge&& merge, size_t minChunkSize = MIN_CHUNK_SIZE) {
+        if (!inMemory()) {
+            State       state;
+            std::string line;
+            while (getline(line)) {
+                if (!line.empty() && line.back() == '\r') {
+                    line.pop_back();
+                }
+                onRecord(state, std::string_view(line));
+            }
+            merge(std::move(state));
+            return true;
+        }
+
+        // Padded so neighbouring chunks don't share a cache line while they are written
+        struct alignas(64) Slot {
+            State state;
+        };
+
+        const std::vector<std::string_view> chunks = splitChunks(remaining(), Threadpool::pool().num_threads() * 4, minChunkSize);
+        std::vector<Slot>                   slots(chunks.size());
+
+        Threadpool::TaskGroup group;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            Threadpool::submit(group, [&onRecord, &slots, &chunks, i]() {
+                State& state = slots[i].state;
+                forEachLine(chunks[i], [&onRecord, &state](std::string_view record) { onRecord(state, record); });
+            });
+        }
+        Threadpool::join(group);
+
+        for (auto& slot : slots) {
+            merge(std::move(slot.state));
+        }
+        skip(remaining().size());
+        m_fs.setstate(std::ios_base::eofbit);
+        return true;
+    }
+
+    // Same, for records that need no per chunk state. onRecord(std::string_view) is called
+    // concurrently and in no particular order.
+    template <typename OnRecord>
+    bool forEachRecord(OnRecord&& onRecord, size_t minChunkSize = MIN_CHUNK_SIZE) {
+        struct Empty {};
+        return parseChunked<Empty>([&onRecord](Empty&, std::string_view record) { onRecord(record); },
+                                   [](Empty&&) {},
+                                   minChunkSize);
+    }
+
+    static const size_t MIN_CHUNK_SIZE = 1048576; // 1MB, smaller chunks aren't worth a task
+
 private:
+    // Cuts text into about numChunks pieces of at least minChunkSize, each ending just after a '\n'
+    static std::vector<std::string_view> splitChunks(std::string_view text, size_t numChunks, size_t minChunkSize);
+
+    // Calls onRecord with every line of text, without its line ending
+    template <typename OnRecord>
+    static void forEachLine(std::string_view text, OnRecord&& onRecord) {
+        while (!text.empty()) {
+            size_t len  = text.find('\n');
+            size_t next = len + 1;
+            if (len == std::string_view::npos) {
+                len  = text.size();
+                next = text.size();
+            }
+
+            std::string_view record = text.substr(0, len);
+            if (!record.empty() && record.back() == '\r') {
+                record.remove_suffix(1);
+            }
+            onRecord(record);
+            text.remove_prefix(next);
+        }
+    }
+
+    // decode(const char* src, size_t firstRecord, size_t numRecords) is handed the records in batches
+    template <typename Layout, typename Decode>
+    size_t readRecordBatches(size_t count, Decode&& decode) {
+        if (!m_fs.good()) {
+            m_fs.setstate(std::ios_base::failbit);
+            return 0;
+        }
+
+        if (inMemory()) {
+            const std::string_view rest = remaining();
+            const size_t           ret  = std::min(count, rest.size() / Layout::size);
+            decode(rest.data(), 0, ret);
+            if (ret < count) {
+                skip(rest.size());
+                m_fs.setstate(std::ios_base::eofbit | std::ios_base::failbit);
+            }
+            else {
+                skip(ret * Layout::size);
+            }
+            return ret;
+        }
+
+        const size_t batchSize = std::max<size_t>(1, RECORD_BATCH_SIZE / Layout::size);
+        size_t       ret       = 0;
+        while (ret < count) {
+            const size_t batch = std::min(batchSize, count - ret);
+            if (m_recordBuf.size() < batch * Layout::size) {
+                m_recordBuf.resize(batch * Layout::size);
+            }
+
+            m_fs.read(m_recordBuf.data(), std::streamsize(batch * Layout::size));
+            const size_t numRead = size_t(m_fs.gcount()) / Layout::size;
+            decode(m_recordBuf.data(), ret, numRead);
+            ret += numRead;
+            if (numRead < batch) break;
+        }
+        return ret;
+    }
+
+    FileReader& parseField(std::string& data); // parse<ReadModeAscii, std::string> straight from memory
+
+    // Numbers that std::from_chars can convert, chars still go through operator>> since it reads them as characters
+    template <typename T>
+    static constexpr bool usesFromChars() {
+        using U = std::remove_cv_t<T>;
+        return (std::is_integral_v<U> && !std::is_same_v<U, bool> && !std::is_same_v<U, char> &&
+                !std::is_same_v<U, signed char> && !std::is_same_v<U, unsigned char> && !std::is_same_v<U, wchar_t> &&
+                !std::is_same_v<U, char8_t> && !std::is_same_v<U, char16_t> && !std::is_same_v<U, char32_t>) ||
+               std::is_same_v<U, float> || std::is_same_v<U, double>;
+    }
+
+    // parse<ReadModeAscii, T> for numbers, straight from memory without going through the locale
+    template <typename T>
+    FileReader& parseNumber(T& data) {
+        if (!m_fs.good()) {
+            m_fs.setstate(std::ios_base::failbit);
+            return *this;
+        }
+
+        const std::string_view rest = m_viewBuf.remaining();
+
+        // operator>> skips leading whitespace and accepts a leading '+', from_chars does neither
+        size_t start = 0;
+        while (start < rest.size() && std::isspace(static_cast<unsigned char>(rest[start]))) {
+            ++start;
+        }
+        if (start == rest.size()) {
+            // Nothing left to convert, operator>> leaves data alone in this case
+            m_viewBuf.advance(start);
+            m_fs.setstate(std::ios_base::failbit | std::ios_base::eofbit);
+            return *this;
+        }
+
+        const char* first = rest.data() + start;
+        const char* last  = rest.data() + rest.size();
+
+        // operator>> also reads "-n" into an unsigned type, as n wrapped around, from_chars doesn't
+        bool negate = false;
+        if (first != last && *first == '+') {
+            ++first;
+        }
+        else if (std::is_unsigned_v<T> && first != last && *first == '-') {
+            negate = true;
+            ++first;
+        }
+
+        const auto result = std::from_chars(first, last, data);
+        if (result.ec != std::errc()) {
+            if (result.ec == std::errc::invalid_argument) {
+                data = T();
+            }
+            else if constexpr (std::is_integral_v<T>) {
+                data = (*first == '-') ? std::numeric_limits<T>::min() : std::numeric_limits<T>::max();
+            }
+            m_viewBuf.advance(start);
+            m_fs.setstate(std::ios_base::failbit);
+            return *this;
+        }
+
+        if (negate) {
+            data = T(T(0) - data);
+        }
+
+        m_viewBuf.advance(size_t(result.ptr - rest.data()));
+        if (result.ptr == last) {
+            m_fs.setstate(std::ios_base::eofbit);
+        }
+        return ignore(1, ',');
+    }
+
     std::iostream     m_fs;
 
     // Storage
     std::filebuf      m_fileBuf;
-    std::stringbuf    m_stringBuf;
+    ViewStreamBuf     m_viewBuf;  // Over m_map or m_buf, whichever holds the file
+    PrefetchStreamBuf m_prefetchBuf;
+    DecompressStreamBuf m_decompressBuf;
+    MappedFile        m_map;
 //    std::vector<char> m_buf;
     std::string       m_buf;
+    std::vector<char> m_recordBuf; // Staging for readRecords() when the file isn't in memory
+
+    fs::path          m_path;
+    RecordIndex       m_recordIndex; // Empty until seekToRecord() or recordIndex() needs it
 };
@@ -0,0 +1,144 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Move-only replacement for std::function<void()>.
+// Callables up to InlineSize bytes that can be moved without throwing are
+// stored in place, so a lambda with a handful of captures never allocates.
+// Anything bigger falls back to a single heap allocation.
+class InplaceTask
+{
+public:
+    // Big enough to hold a std::function on every standard library we build with,
+    // so TaskList entries can be moved in without allocating again
+    static constexpr size_t InlineSize = 64;
+
+    InplaceTask() noexcept : mVTable(nullptr) {}
+    InplaceTask(std::nullptr_t) noexcept : mVTable(nullptr) {}
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, InplaceTask> &&
+                                                      std::is_invocable_v<std::decay_t<F>&>>>
+    InplaceTask(F&& func) : mVTable(nullptr)
+    {
+        using Func = std::decay_t<F>;
+
+        // Empty std::function or null function pointers stay empty
+        if constexpr (std::is_constructible_v<bool, const Func&>) {
+            if (!static_cast<bool>(func)) return;
+        }
+
+        if constexpr (fitsInline<Func>()) {
+            ::new (static_cast<void*>(mStorage)) Func(std::forward<F>(func));
+            mVTable = &InlineOps<Func>::table;
+        }
+        else {
+            *reinterpret_cast<Func**>(mStorage) = new Func(std::forward<F>(func));
+            mVTable = &HeapOps<Func>::table;
+        }
+    }
+
+    InplaceTask(InplaceTask&& other) noexcept : mVTable(nullptr)
+    {
+        take(other);
+    }
+
+    InplaceTask& operator=(InplaceTask&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    InplaceTask(const InplaceTask&)            = delete;
+    InplaceTask& operator=(const InplaceTask&) = delete;
+
+    ~InplaceTask() { reset(); }
+
+    void operator()() { mVTable->invoke(mStorage); }
+
+    explicit operator bool() const { return mVTable != nullptr; }
+
+    // Destroys the held callable, and with it anything it captured
+    void reset()
+    {
+        if (mVTable) {
+            mVTable->destroy(mStorage);
+            mVTable = nullptr;
+        }
+    }
+
+private:
+    struct VTable {
+        void (*invoke)(void* storage);
+        void (*move)(void* dst, void* src) noexcept; // Move constructs into dst and destroys src
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template <typename Func>
+    static constexpr bool fitsInline()
+    {
+        return sizeof(Func) <= InlineSize &&
+               alignof(Func) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible_v<Func>;
+    }
+
+    template <typename Func>
+    struct InlineOps {
+        static void invoke(void* storage) { (*static_cast<Func*>(storage))(); }
+        static void move(void* dst, void* src) noexcept
+        {
+            ::new (dst) Func(std::move(*static_cast<Func*>(src)));
+            static_cast<Func*>(src)->~Func();
+        }
+        static void destroy(void* storage) noexcept { static_cast<Func*>(storage)->~Func(); }
+
+        static constexpr VTable table = { &invoke, &move, &destroy };
+    };
+
+    template <typename Func>
+    struct HeapOps {
+        static void invoke(void* storage) { (**static_cast<Func**>(storage))(); }
+        static void move(void* dst, void* src) noexcept { *static_cast<Func**>(dst) = *static_cast<Func**>(src); }
+        static void destroy(void* storage) noexcept { delete *static_cast<Func**>(storage); }
+
+        static constexpr VTable table = { &invoke, &move, &destroy };
+    };
+
+    void take(InplaceTask& other) noexcept
+    {
+        if (other.mVTable) {
+            other.mVTable->move(mStorage, other.mStorage);
+            mVTable       = other.mVTable;
+            other.mVTable = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char mStorage[InlineSize];
+    const VTable*                           mVTable;
+};
@@ -0,0 +1,158 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const fs::path& filePath) {
+    open(filePath);
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept {
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        close();
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_open, other.m_open);
+#ifdef _WIN32
+        std::swap(m_file, other.m_file);
+        std::swap(m_mapping, other.m_mapping);
+#endif
+    }
+    return *this;
+}
+
+bool MappedFile::open(const fs::path& filePath) {
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileW(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize)) {
+        CloseHandle(file);
+        return false;
+    }
+
+    m_file = file;
+    m_size = size_t(fileSize.QuadPart);
+    if (m_size > 0) {
+        // Mapping an empty file fails, so only map when there is something to map
+        m_mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping) {
+            m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        }
+        if (!m_data) {
+            close();
+            return false;
+        }
+    }
+#else
+    const int fd = ::open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return false;
+    }
+
+    m_size = size_t(st.st_size);
+    if (m_size > 0) {
+        void* addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            ::close(fd);
+            m_size = 0;
+            return false;
+        }
+        m_data = static_cast<const char*>(addr);
+    }
+    ::close(fd); // The mapping keeps its own reference to the file
+#endif
+
+    m_open = true;
+    return true;
+}
+
+void MappedFile::close() {
+#ifdef _WIN32
+    if (m_data)    { UnmapViewOfFile(m_data); }
+    if (m_mapping) { CloseHandle(m_mapping); }
+    if (m_file)    { CloseHandle(m_file); }
+    m_mapping = nullptr;
+    m_file    = nullptr;
+#else
+    if (m_data) { munmap(const_cast<char*>(m_data), m_size); }
+#endif
+    m_data = nullptr;
+    m_size = 0;
+    m_open = false;
+}
+
+void MappedFile::advise(Access access, size_t offset, size_t length) const {
+    if (!m_data || offset >= m_size) return;
+    length = std::min(length, m_size - offset);
+
+#ifdef _WIN32
+    // Only WillNeed has an equivalent, read-ahead was already chosen when the file was opened
+    if (access == Access::WillNeed) {
+        WIN32_MEMORY_RANGE_ENTRY range;
+        range.VirtualAddress = const_cast<char*>(m_data + offset);
+        range.NumberOfBytes  = length;
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+#else
+    static const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+
+    // madvise wants a page aligned start, the mapping itself always is
+    const size_t alignedOffset = offset & ~(pageSize - 1);
+    char*        start         = const_cast<char*>(m_data) + alignedOffset;
+    length += offset - alignedOffset;
+
+    int advice = MADV_NORMAL;
+    switch (access) {
+    case Access::Sequential: advice = MADV_SEQUENTIAL; break;
+    case Access::Random:     advice = MADV_RANDOM;     break;
+    case Access::WillNeed:   advice = MADV_WILLNEED;   break;
+    case Access::DontNeed:   advice = MADV_DONTNEED;   break;
+    default:                 break;
+    }
+    madvise(start, length, advice);
+#endif
+}
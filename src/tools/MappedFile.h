@@ -0,0 +1,69 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include "VfCommon.h"
+
+#include <string_view>
+
+// Read-only memory mapping of a whole file, the pages are only read in as they are touched.
+// Files of any size can be mapped on a 64-bit build, and an empty file maps to an empty view.
+class MappedFile {
+public:
+    enum class Access { Normal,
+                        Sequential, // Aggressive read-ahead, pages behind the reader can be dropped early
+                        Random,     // No read-ahead
+                        WillNeed,   // Start reading the whole range in now
+                        DontNeed }; // Done with the range, its pages can be reclaimed
+
+    MappedFile() = default;
+    explicit MappedFile(const fs::path& filePath);
+    ~MappedFile();
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&)            = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const fs::path& filePath);
+    void close();
+
+    bool is_open() const { return m_open; }
+    explicit operator bool() const { return m_open; }
+
+    const char*      data() const { return m_data; }
+    size_t           size() const { return m_size; }
+    std::string_view view() const { return std::string_view(m_data, m_size); }
+
+    // Only a hint, failures are ignored. The range is rounded out to whole pages.
+    void advise(Access access) const { advise(access, 0, m_size); }
+    void advise(Access access, size_t offset, size_t length) const;
+
+private:
+    const char* m_data = nullptr;
+    size_t      m_size = 0;
+    bool        m_open = false;
+#ifdef _WIN32
+    void*       m_file    = nullptr; // HANDLE
+    void*       m_mapping = nullptr; // HANDLE
+#endif
+};
@@ -0,0 +1,68 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "PointCloudReader.h"
+
+PointCloudReader::PointCloudReader(const fs::path& filePath, Backend backend) :
+    FileReader(filePath, backend)
+{
+}
+
+bool PointCloudReader::readAndParse() {
+    if (!readable()) return false;
+
+    const bool ret = parseChunked<ChunkState>(&PointCloudReader::parseRecord,
+                                              [this](ChunkState&& state) { m_points.merge(std::move(state.points)); });
+    m_points.flush();
+    return ret;
+}
+
+void PointCloudReader::parseRecord(ChunkState& state, std::string_view record) {
+    float values[4];
+
+    // Plain "x,y,z,i" goes straight through from_chars, which stops at each comma
+    const char* pos = record.data();
+    const char* end = record.data() + record.size();
+    int         num = 0;
+    for (; num < 4; ++num) {
+        const auto result = std::from_chars(pos, end, values[num]);
+        if (result.ec != std::errc()) break;
+
+        pos = result.ptr;
+        if (num < 3) {
+            if (pos == end || *pos != ',') break;
+            ++pos;
+        }
+    }
+    if (num == 4 && pos == end) {
+        state.points.append(values[0], values[1], values[2], values[3]);
+        return;
+    }
+
+    // Anything else (spaces, '+' signs, headers) takes the general path
+    CsvScanner::splitFields(record, state.fields);
+    if (state.fields.size() != 4) return;
+
+    for (int i = 0; i < 4; ++i) {
+        if (!CsvScanner::toNumber(state.fields[i], values[i])) return;
+    }
+    state.points.append(values[0], values[1], values[2], values[3]);
+}
@@ -0,0 +1,51 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include "ColumnBatch.h"
+#include "FileReader.h"
+
+// Reads comma separated x, y, z, intensity rows straight into column batches, eg scan or
+// melt pool samples. Lines that aren't four numbers (headers, comments) are skipped.
+// Also the example of a reader that fills a ColumnSink rather than pushing values one at a
+// time into containers of its own.
+class PointCloudReader : public FileReader {
+public:
+    using Points = ColumnSink<float, float, float, float>; // x, y, z, intensity
+
+    explicit PointCloudReader(const fs::path& filePath, Backend backend = Backend::Mapped);
+
+    bool readAndParse() override;
+
+    // After readAndParse(), every row in file order
+    Points& points() { return m_points; }
+
+private:
+    struct ChunkState {
+        Points                        points;
+        std::vector<std::string_view> fields; // Reused for every record
+    };
+
+    static void parseRecord(ChunkState& state, std::string_view record);
+
+    Points m_points;
+};
@@ -0,0 +1,185 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "PrefetchStreamBuf.h"
+
+PrefetchStreamBuf::~PrefetchStreamBuf() {
+    close();
+}
+
+bool PrefetchStreamBuf::open(const fs::path& filePath, const Options& options) {
+    close();
+    if (!m_file.open(filePath, options.bypassCache ? RawFile::Caching::Bypass : RawFile::Caching::Normal)) return false;
+
+    // Whole multiples of the alignment keep every block's offset aligned for direct reads
+    const size_t alignment = RawFile::DIRECT_ALIGNMENT;
+    m_options              = options;
+    m_options.blockSize    = std::max<size_t>((m_options.blockSize + alignment - 1) / alignment * alignment, alignment);
+    m_dropBehind           = options.bypassCache && !m_file.bypassesCache();
+
+    m_blocks.resize(m_options.readAhead + 1);
+    for (auto& block : m_blocks) {
+        block.data.reset(new (std::align_val_t(alignment)) char[m_options.blockSize]);
+    }
+
+    restart(0);
+    return true;
+}
+
+void PrefetchStreamBuf::close() {
+    drain();
+    m_blocks.clear();
+    m_file.close();
+    m_active     = false;
+    m_skip       = 0;
+    m_dropBehind = false;
+    setg(nullptr, nullptr, nullptr);
+}
+
+void PrefetchStreamBuf::drain() {
+    for (auto& block : m_blocks) {
+        if (block.fill.valid()) {
+            try {
+                block.fill.get();
+            }
+            catch (...) {
+                // The data is being thrown away, so is whatever went wrong reading it
+            }
+        }
+    }
+}
+
+void PrefetchStreamBuf::restart(uint64_t offset) {
+    drain();
+
+    // Direct reads have to start on an aligned offset, the bytes before the one asked for are skipped
+    const uint64_t start = m_file.bypassesCache() ? offset / RawFile::DIRECT_ALIGNMENT * RawFile::DIRECT_ALIGNMENT : offset;
+
+    m_active     = false;
+    m_current    = 0;
+    m_nextOffset = start;
+    m_skip       = size_t(offset - start);
+    setg(nullptr, nullptr, nullptr);
+
+    for (auto& block : m_blocks) {
+        scheduleNext(block);
+    }
+}
+
+void PrefetchStreamBuf::scheduleNext(Block& block) {
+    block.bytes = 0;
+    if (m_nextOffset >= m_file.size()) {
+        block.offset = m_file.size();
+        return; // Past the end, block.fill stays invalid
+    }
+
+    block.offset = m_nextOffset;
+    m_nextOffset += m_options.blockSize;
+
+    // Direct reads of the last block ask for whole aligned blocks too, and come back short
+    uint64_t length = std::min<uint64_t>(m_options.blockSize, m_file.size() - block.offset);
+    if (m_file.bypassesCache()) {
+        length = (length + RawFile::DIRECT_ALIGNMENT - 1) / RawFile::DIRECT_ALIGNMENT * RawFile::DIRECT_ALIGNMENT;
+    }
+
+    block.fill = Threadpool::pool(Threadpool::PoolId::IO).submit([this, &block, length]() {
+        block.bytes = m_file.readAt(block.offset, block.data.get(), size_t(length));
+    });
+}
+
+PrefetchStreamBuf::int_type PrefetchStreamBuf::underflow() {
+    if (gptr() < egptr()) {
+        return traits_type::to_int_type(*gptr());
+    }
+    if (m_blocks.empty()) {
+        return traits_type::eof();
+    }
+
+    // Done with the current block, hand it back to the reader for the next block out
+    if (m_active) {
+        if (m_dropBehind) {
+            m_file.dropCache(m_blocks[m_current].offset, m_blocks[m_current].bytes);
+        }
+        scheduleNext(m_blocks[m_current]);
+        m_current = (m_current + 1) % m_blocks.size();
+    }
+
+    Block& block = m_blocks[m_current];
+    m_active     = true;
+    if (!block.fill.valid()) {
+        setg(nullptr, nullptr, nullptr);
+        return traits_type::eof();
+    }
+
+    // Rethrows read errors, the istream turns them into badbit
+    Threadpool::pool(Threadpool::PoolId::IO).join(std::move(block.fill));
+    const size_t skip = std::exchange(m_skip, 0);
+    if (block.bytes <= skip) {
+        setg(nullptr, nullptr, nullptr);
+        return traits_type::eof();
+    }
+
+    setg(block.data.get(), block.data.get() + skip, block.data.get() + block.bytes);
+    return traits_type::to_int_type(*gptr());
+}
+
+std::streamsize PrefetchStreamBuf::showmanyc() {
+    const uint64_t pos = position();
+    return pos < m_file.size() ? std::streamsize(m_file.size() - pos) : std::streamsize(-1);
+}
+
+uint64_t PrefetchStreamBuf::position() const {
+    if (!m_active) {
+        return m_blocks.empty() ? 0 : m_blocks[m_current].offset + m_skip;
+    }
+    return m_blocks[m_current].offset + uint64_t(gptr() - eback());
+}
+
+PrefetchStreamBuf::pos_type PrefetchStreamBuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+        base = off_type(position());
+    }
+    else if (dir == std::ios_base::end) {
+        base = off_type(m_file.size());
+    }
+    return seekpos(pos_type(base + off), which);
+}
+
+PrefetchStreamBuf::pos_type PrefetchStreamBuf::seekpos(pos_type pos, std::ios_base::openmode which) {
+    const off_type target = off_type(pos);
+    if (!(which & std::ios_base::in) || !is_open() || target < 0 || uint64_t(target) > m_file.size()) {
+        return pos_type(off_type(-1));
+    }
+
+    // Within the block we're in, eg tellg() or a short step back, nothing needs to be read again
+    if (m_active && eback()) {
+        const Block& block = m_blocks[m_current];
+        if (uint64_t(target) >= block.offset && uint64_t(target) <= block.offset + block.bytes) {
+            setg(eback(), eback() + (uint64_t(target) - block.offset), egptr());
+            return pos;
+        }
+    }
+    if (uint64_t(target) != position()) {
+        restart(uint64_t(target));
+    }
+    return pos;
+}
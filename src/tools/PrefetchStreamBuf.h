@@ -0,0 +1,91 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include "RawFile.h"
+#include "Threadpool.h"
+
+#include <memory>
+#include <new>
+#include <streambuf>
+#include <vector>
+
+// Read-only stream buffer that reads ahead on the I/O pool. The file is read in fixed size
+// blocks from a ring: while the parser works through one block, the next readAhead blocks
+// are being filled in the background. Memory use is (readAhead + 1) * blockSize, whatever
+// the size of the file.
+class PrefetchStreamBuf : public std::streambuf {
+public:
+    struct Options {
+        size_t blockSize   = 8 << 20; // 8MB
+        size_t readAhead   = 3;       // Blocks in flight besides the one being parsed
+        bool   bypassCache = false;   // For one-pass reads of huge files: read around the page cache (O_DIRECT),
+                                      // or where the file system won't, drop each block from it once parsed
+    };
+
+    PrefetchStreamBuf() = default;
+    ~PrefetchStreamBuf() override;
+
+    PrefetchStreamBuf(const PrefetchStreamBuf&)            = delete;
+    PrefetchStreamBuf& operator=(const PrefetchStreamBuf&) = delete;
+
+    bool open(const fs::path& filePath, const Options& options);
+    bool open(const fs::path& filePath) { return open(filePath, Options()); }
+    void close();
+
+    bool     is_open()       const { return m_file.is_open(); }
+    uint64_t size()          const { return m_file.size(); }
+    bool     bypassesCache() const { return m_file.bypassesCache(); } // Direct reads, rather than dropping behind
+
+protected:
+    int_type        underflow() override;
+    std::streamsize showmanyc() override;
+    pos_type        seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    pos_type        seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+    // Blocks are aligned for direct reads whether or not they are used
+    struct AlignedDelete {
+        void operator()(char* data) const { ::operator delete[](data, std::align_val_t(RawFile::DIRECT_ALIGNMENT)); }
+    };
+
+    struct Block {
+        std::unique_ptr<char[], AlignedDelete> data;
+        uint64_t                               offset = 0; // Where in the file data starts
+        size_t                                 bytes  = 0; // Valid once fill has completed
+        Threadpool::Waitable                   fill;       // Invalid if nothing is scheduled, ie past the end of the file
+    };
+
+    void     restart(uint64_t offset); // Drops everything in flight and starts reading ahead from offset
+    void     scheduleNext(Block& block);
+    void     drain();                  // Waits for every fill in flight, dropping their results
+    uint64_t position() const;
+
+    RawFile            m_file;
+    Options            m_options;
+    std::vector<Block> m_blocks;
+    size_t             m_current    = 0;     // Block in the get area, once m_active
+    bool               m_active     = false;
+    uint64_t           m_nextOffset = 0;     // Start of the next block to schedule
+    size_t             m_skip       = 0;     // Bytes of the first block before the position restart() was asked for
+    bool               m_dropBehind = false; // Wanted to bypass the cache but can't read direct
+};
@@ -0,0 +1,192 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "RawFile.h"
+
+#include <new>
+#include <system_error>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+RawFile::~RawFile() {
+    close();
+}
+
+RawFile::RawFile(RawFile&& other) noexcept {
+    *this = std::move(other);
+}
+
+RawFile& RawFile::operator=(RawFile&& other) noexcept {
+    if (this != &other) {
+        close();
+#ifdef _WIN32
+        std::swap(m_handle, other.m_handle);
+#else
+        std::swap(m_fd, other.m_fd);
+#endif
+        std::swap(m_size, other.m_size);
+        std::swap(m_open, other.m_open);
+        std::swap(m_direct, other.m_direct);
+        std::swap(m_error, other.m_error);
+    }
+    return *this;
+}
+
+bool RawFile::open(const fs::path& filePath, Caching caching) {
+    close();
+    m_error.clear();
+
+    // Whether the file system takes direct reads only shows on the first one, so try one
+    if (caching == Caching::Bypass && openHandle(filePath, true)) {
+        char* probe = static_cast<char*>(::operator new(DIRECT_ALIGNMENT, std::align_val_t(DIRECT_ALIGNMENT)));
+        bool  ok    = true;
+        try {
+            readAt(0, probe, DIRECT_ALIGNMENT);
+        }
+        catch (const std::system_error&) {
+            ok = false;
+        }
+        ::operator delete(probe, std::align_val_t(DIRECT_ALIGNMENT));
+
+        if (ok) {
+            m_direct = true;
+            return true;
+        }
+        close();
+    }
+    return openHandle(filePath, false);
+}
+
+bool RawFile::openHandle(const fs::path& filePath, bool direct) {
+#ifdef _WIN32
+    const DWORD flags  = direct ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN;
+    HANDLE      handle = CreateFileW(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL | flags, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        m_error = std::error_code(int(GetLastError()), std::system_category());
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(handle, &fileSize)) {
+        m_error = std::error_code(int(GetLastError()), std::system_category());
+        CloseHandle(handle);
+        return false;
+    }
+    m_handle = handle;
+    m_size   = uint64_t(fileSize.QuadPart);
+#else
+    int flags = O_RDONLY | O_CLOEXEC;
+#ifdef O_DIRECT
+    if (direct) flags |= O_DIRECT;
+#else
+    if (direct) {
+        m_error = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+#endif
+    const int fd = ::open(filePath.c_str(), flags);
+    if (fd < 0) {
+        m_error = std::error_code(errno, std::generic_category());
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        m_error = std::error_code(errno, std::generic_category());
+        ::close(fd);
+        return false;
+    }
+    m_fd   = fd;
+    m_size = uint64_t(st.st_size);
+#endif
+
+    m_error.clear();
+    m_open = true;
+    return true;
+}
+
+void RawFile::close() {
+#ifdef _WIN32
+    if (m_handle) { CloseHandle(m_handle); }
+    m_handle = nullptr;
+#else
+    if (m_fd >= 0) { ::close(m_fd); }
+    m_fd = -1;
+#endif
+    m_size   = 0;
+    m_open   = false;
+    m_direct = false;
+}
+
+void RawFile::dropCache(uint64_t offset, uint64_t length) const {
+#ifdef __linux__
+    if (m_fd >= 0) {
+        posix_fadvise(m_fd, off_t(offset), off_t(length), POSIX_FADV_DONTNEED);
+    }
+#else
+    (void)offset;
+    (void)length;
+#endif
+}
+
+size_t RawFile::readAt(uint64_t offset, void* buffer, size_t length) const {
+    char*  dst   = static_cast<char*>(buffer);
+    size_t total = 0;
+
+    // Both OSes may return short reads, so keep going until we hit the end of the file
+    while (total < length) {
+#ifdef _WIN32
+        OVERLAPPED overlapped = {};
+        overlapped.Offset     = DWORD(offset + total);
+        overlapped.OffsetHigh = DWORD((offset + total) >> 32);
+
+        DWORD      bytesRead = 0;
+        const DWORD request  = DWORD(std::min<size_t>(length - total, 1u << 30));
+        if (!ReadFile(m_handle, dst + total, request, &bytesRead, &overlapped)) {
+            const DWORD error = GetLastError();
+            if (error == ERROR_HANDLE_EOF) break;
+            throw std::system_error(int(error), std::system_category(), "ReadFile");
+        }
+#else
+        const size_t  request   = length - total;
+        const ssize_t bytesRead = pread(m_fd, dst + total, request, off_t(offset + total));
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            throw std::system_error(errno, std::generic_category(), "pread");
+        }
+#endif
+        if (bytesRead == 0) break;
+        total += size_t(bytesRead);
+
+        // A direct read only comes back short at the end of the file, and going on from there
+        // would be an unaligned read, which fails
+        if (m_direct && size_t(bytesRead) < size_t(request)) break;
+    }
+    return total;
+}
@@ -0,0 +1,80 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include "VfCommon.h"
+
+#include <system_error>
+
+// Read-only file handle for positional reads. readAt() doesn't move a shared file
+// pointer, so any number of threads can read different parts of one file at once.
+class RawFile {
+public:
+    enum class Caching { Normal,
+                         Bypass }; // O_DIRECT / FILE_FLAG_NO_BUFFERING, reads skip the page cache
+
+    // With Bypass, readAt() offsets, lengths and buffers must all be multiples of DIRECT_ALIGNMENT
+    static const size_t DIRECT_ALIGNMENT = 4096;
+
+    RawFile() = default;
+    explicit RawFile(const fs::path& filePath, Caching caching = Caching::Normal) { open(filePath, caching); }
+    ~RawFile();
+
+    RawFile(RawFile&& other) noexcept;
+    RawFile& operator=(RawFile&& other) noexcept;
+    RawFile(const RawFile&)            = delete;
+    RawFile& operator=(const RawFile&) = delete;
+
+    // Bypass falls back to a normal open where the file system won't do direct reads (eg tmpfs),
+    // check bypassesCache() for what was granted
+    bool open(const fs::path& filePath, Caching caching = Caching::Normal);
+    void close();
+
+    bool     is_open()       const { return m_open; }
+    uint64_t size()          const { return m_size; }
+    bool     bypassesCache() const { return m_direct; }
+
+    // Why the last open() failed, taken before any cleanup could overwrite errno / GetLastError()
+    const std::error_code& error() const { return m_error; }
+
+    // Tells the OS the cached pages of a range won't be needed again, so a one-pass read
+    // doesn't push out data that is. Only does something on Linux.
+    void dropCache(uint64_t offset, uint64_t length) const;
+
+    // Reads until length bytes are in or the end of the file is reached, and returns how many
+    // bytes were read. Throws std::system_error if the OS reports an error.
+    size_t readAt(uint64_t offset, void* buffer, size_t length) const;
+
+private:
+    bool openHandle(const fs::path& filePath, bool direct);
+
+#ifdef _WIN32
+    void*    m_handle = nullptr; // HANDLE
+#else
+    int      m_fd     = -1;
+#endif
+    uint64_t m_size   = 0;
+    bool     m_open   = false;
+    bool     m_direct = false;
+
+    std::error_code m_error;
+};
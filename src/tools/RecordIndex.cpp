@@ -0,0 +1,223 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "RecordIndex.h"
+#include "MappedFile.h"
+#include "Threadpool.h"
+
+#include <cstring>
+#include <fstream>
+
+namespace {
+    const char     SIDECAR_MAGIC[8] = { 'V', 'F', 'R', 'I', 'D', 'X', '0', '1' };
+    const uint64_t MAX_OFFSETS      = uint64_t(1) << 40; // Sanity limit on what load() will allocate
+
+    struct SidecarHeader {
+        char     magic[8];
+        uint64_t stride;
+        uint64_t numRecords;
+        uint64_t dataSize;
+        int64_t  dataTime;
+        uint64_t numOffsets;
+    };
+
+    int64_t modificationTime(const fs::path& file) {
+        std::error_code ec;
+        const auto      time = fs::last_write_time(file, ec);
+        return ec ? 0 : int64_t(time.time_since_epoch().count());
+    }
+
+    // Calls onNewline(offset) for every '\n' in text
+    template <typename OnNewline>
+    void forEachNewline(std::string_view text, OnNewline&& onNewline) {
+        const char* begin = text.data();
+        const char* end   = text.data() + text.size();
+        for (const char* pos = begin; pos < end; ++pos) {
+            pos = static_cast<const char*>(memchr(pos, '\n', size_t(end - pos)));
+            if (!pos) break;
+            onNewline(size_t(pos - begin));
+        }
+    }
+}
+
+void RecordIndex::build(std::string_view text, uint64_t stride) {
+    m_stride   = std::max<uint64_t>(stride, 1);
+    m_dataSize = text.size();
+    m_dataTime = 0;
+
+    // Two passes over the chunks in parallel: count the newlines in each, which gives every
+    // chunk the number of its first record, then note the offsets that fall on the stride
+    const size_t numChunks = std::max<size_t>(std::min<size_t>(text.size() / MIN_CHUNK_SIZE, Threadpool::pool().num_threads() * 4), 1);
+    const size_t chunkSize = text.size() / numChunks + 1;
+
+    std::vector<uint64_t> newlines(numChunks, 0);
+    {
+        Threadpool::TaskGroup group;
+        for (size_t i = 0; i < numChunks; ++i) {
+            Threadpool::submit(group, [&text, &newlines, chunkSize, i]() {
+                uint64_t count = 0;
+                forEachNewline(text.substr(std::min(i * chunkSize, text.size()), chunkSize), [&count](size_t) { count++; });
+                newlines[i] = count;
+            });
+        }
+        Threadpool::join(group);
+    }
+
+    // Record n + 1 starts just after newline n. A last line with no newline is still a record.
+    uint64_t totalNewlines = 0;
+    std::vector<uint64_t> firstNewline(numChunks);
+    for (size_t i = 0; i < numChunks; ++i) {
+        firstNewline[i] = totalNewlines;
+        totalNewlines += newlines[i];
+    }
+    m_numRecords = totalNewlines + ((!text.empty() && text.back() != '\n') ? 1 : 0);
+
+    m_offsets.assign(size_t((m_numRecords + m_stride - 1) / m_stride), 0);
+    if (m_offsets.empty()) {
+        m_offsets.push_back(0); // Even an empty file has its end to seek to
+    }
+    {
+        Threadpool::TaskGroup group;
+        for (size_t i = 0; i < numChunks; ++i) {
+            Threadpool::submit(group, [this, &text, &firstNewline, chunkSize, i]() {
+                const size_t chunkStart = std::min(i * chunkSize, text.size());
+                uint64_t     record     = firstNewline[i] + 1;
+                forEachNewline(text.substr(chunkStart, chunkSize), [this, &record, chunkStart](size_t offset) {
+                    // Every chunk writes its own entries, no two chunks share one
+                    if (record % m_stride == 0 && record < m_numRecords) {
+                        m_offsets[size_t(record / m_stride)] = chunkStart + offset + 1;
+                    }
+                    record++;
+                });
+            });
+        }
+        Threadpool::join(group);
+    }
+}
+
+bool RecordIndex::build(const fs::path& dataFile, uint64_t stride) {
+    MappedFile file;
+    if (!file.open(dataFile)) return false;
+
+    file.advise(MappedFile::Access::Sequential);
+    build(file.view(), stride);
+    m_dataTime = modificationTime(dataFile);
+    return true;
+}
+
+bool RecordIndex::save(const fs::path& indexFile) const {
+    SidecarHeader header;
+    memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+    header.stride     = m_stride;
+    header.numRecords = m_numRecords;
+    header.dataSize   = m_dataSize;
+    header.dataTime   = m_dataTime;
+    header.numOffsets = m_offsets.size();
+
+    // Written aside and renamed over, so a reader never sees half an index
+    fs::path tempFile = indexFile;
+    tempFile += ".tmp";
+    {
+        std::ofstream out(tempFile, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(m_offsets.data()), std::streamsize(m_offsets.size() * sizeof(uint64_t)));
+        if (!out) {
+            out.close();
+            std::error_code ec;
+            fs::remove(tempFile, ec);
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(tempFile, indexFile, ec);
+    if (ec) {
+        fs::remove(tempFile, ec);
+        return false;
+    }
+    return true;
+}
+
+bool RecordIndex::load(const fs::path& indexFile, const fs::path& dataFile) {
+    std::ifstream in(indexFile, std::ios::binary);
+    SidecarHeader header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+
+    std::error_code ec;
+    const uint64_t  dataSize = fs::file_size(dataFile, ec);
+    if (ec || memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) != 0 || header.stride == 0 ||
+        header.dataSize != dataSize || header.dataTime != modificationTime(dataFile) ||
+        header.numRecords > dataSize || header.numOffsets > MAX_OFFSETS) {
+        return false;
+    }
+
+    // locate() indexes the offsets by record / stride without checking, so a sidecar that is
+    // damaged, or written by something else, must not get past here. Rebuilding is cheap next to that.
+    const uint64_t numOffsets = std::max<uint64_t>(header.numRecords / header.stride + (header.numRecords % header.stride != 0 ? 1 : 0), 1);
+    if (header.numOffsets != numOffsets) return false;
+
+    std::vector<uint64_t> offsets(size_t(header.numOffsets));
+    if (!in.read(reinterpret_cast<char*>(offsets.data()), std::streamsize(offsets.size() * sizeof(uint64_t)))) return false;
+
+    // Record 0 starts the file, and every later one starts past the one before and inside the file
+    if (offsets[0] != 0) return false;
+    for (size_t i = 1; i < offsets.size(); ++i) {
+        if (offsets[i] <= offsets[i - 1] || offsets[i] >= dataSize) return false;
+    }
+
+    m_offsets    = std::move(offsets);
+    m_stride     = header.stride;
+    m_numRecords = header.numRecords;
+    m_dataSize   = header.dataSize;
+    m_dataTime   = header.dataTime;
+    return true;
+}
+
+bool RecordIndex::loadOrBuild(const fs::path& dataFile, uint64_t stride) {
+    const fs::path indexFile = sidecarPath(dataFile);
+    if (load(indexFile, dataFile) && m_stride == std::max<uint64_t>(stride, 1)) {
+        return true;
+    }
+    if (!build(dataFile, stride)) {
+        return false;
+    }
+    save(indexFile); // Not being able to keep it (eg read-only directory) only costs a rebuild next time
+    return true;
+}
+
+fs::path RecordIndex::sidecarPath(const fs::path& dataFile) {
+    fs::path ret = dataFile;
+    ret += ".ridx";
+    return ret;
+}
+
+bool RecordIndex::locate(uint64_t record, uint64_t& offset, uint64_t& recordsToSkip) const {
+    if (m_offsets.empty() || record > m_numRecords) return false;
+
+    if (record == m_numRecords) {
+        offset        = m_dataSize;
+        recordsToSkip = 0;
+        return true;
+    }
+    offset        = m_offsets[size_t(record / m_stride)];
+    recordsToSkip = record % m_stride;
+    return true;
+}
@@ -0,0 +1,66 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include "VfCommon.h"
+
+#include <string_view>
+
+// Sparse index of the records (lines) of a text file: the byte offset of every stride'th
+// record, so record n is reached with one seek and at most stride - 1 skipped lines.
+// The index is saved next to the file it describes (see sidecarPath()) along with that
+// file's size and modification time, and is rebuilt when either no longer matches.
+class RecordIndex {
+public:
+    static const uint64_t DEFAULT_STRIDE = 4096;
+
+    RecordIndex() = default;
+
+    // Indexes text, cut into chunks that are scanned in parallel on the compute pool
+    void build(std::string_view text, uint64_t stride = DEFAULT_STRIDE);
+    bool build(const fs::path& dataFile, uint64_t stride = DEFAULT_STRIDE);
+
+    bool save(const fs::path& indexFile) const;
+    bool load(const fs::path& indexFile, const fs::path& dataFile); // False if missing, corrupt or stale
+
+    // The saved index if it is still good, otherwise a new one, saved if the directory allows it
+    bool loadOrBuild(const fs::path& dataFile, uint64_t stride = DEFAULT_STRIDE);
+
+    static fs::path sidecarPath(const fs::path& dataFile); // data.csv -> data.csv.ridx
+
+    bool     empty()      const { return m_offsets.empty(); }
+    uint64_t stride()     const { return m_stride; }
+    uint64_t numRecords() const { return m_numRecords; }
+
+    // Where to seek to reach record, and how many records to skip from there.
+    // record == numRecords() is the end of the file. False past that.
+    bool locate(uint64_t record, uint64_t& offset, uint64_t& recordsToSkip) const;
+
+private:
+    static const size_t MIN_CHUNK_SIZE = 4194304; // 4MB, counting newlines is quick
+
+    std::vector<uint64_t> m_offsets;        // m_offsets[i] is where record i * m_stride starts
+    uint64_t              m_stride     = DEFAULT_STRIDE;
+    uint64_t              m_numRecords = 0;
+    uint64_t              m_dataSize   = 0; // Of the file indexed, to tell when the index is stale
+    int64_t               m_dataTime   = 0;
+};
@@ -0,0 +1,272 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+#include "Trie.h"
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Trie for a key set known at compile time, such as the CLI commands. The transition table is
+// generated by the compiler, so there is nothing to build or allocate at startup, and handlers
+// are template arguments called through a switch over the keys, so they can be inlined.
+// Matches exactly like a Trie with the same keys and Mode. Keys that only exist at runtime
+// still go in a Trie.
+//
+//     using CliTrie = StaticTrie<Trie::Mode::Restart,
+//                                StaticEndpoint<"$$ASCII", setAsciiMode>,
+//                                StaticEndpoint<"ACK",     onReply, 1>,
+//                                StaticEndpoint<"NAK",     onReply, 0>>;
+//     CliTrie cli;
+//     cli.process(input);
+template <size_t N>
+struct StaticWord
+{
+    char text[N] = {};
+
+    constexpr StaticWord(const char (&word)[N])
+    {
+        for (size_t i = 0; i < N; i++)
+            text[i] = word[i];
+    }
+    constexpr std::string_view view() const { return std::string_view(text, N - 1); }
+};
+
+// Func is anything callable as Func(int) that can be a template argument: a function, or a
+// lambda that captures nothing
+template <StaticWord Word, auto Func, int Arg = 0>
+struct StaticEndpoint
+{
+    static_assert(Word.view().size() > 0, "Nothing to match on");
+
+    static constexpr std::string_view word = Word.view();
+    static void call() { Func(Arg); }
+};
+
+// Compile time counterpart of Trie::build(), for StaticTrie. The tables come out laid out the
+// same way, see there.
+struct StaticTrieBuilder
+{
+    static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+    template <typename Entry, uint32_t NumNodes, uint32_t NumClasses>
+    struct Tables
+    {
+        std::array<Entry,    size_t(NumNodes) * NumClasses> table      = {};
+        std::array<uint32_t, NumNodes>                      endpointOf = {}; // Key index or NO_NODE
+        std::array<uint32_t, NumNodes>                      suffixOf   = {}; // Longest key that is a proper suffix, AhoCorasick only
+    };
+
+    template <typename Entry>
+    static constexpr Entry endpointBit() { return Entry(Entry(1) << (sizeof(Entry) * 8 - 1)); }
+
+    template <size_t NumKeys>
+    static constexpr std::array<uint16_t, 256> classes(const std::array<std::string_view, NumKeys>& words)
+    {
+        std::array<uint16_t, 256> classOf    = {};
+        uint16_t                  numClasses = 1;
+        for (const std::string_view word : words)
+        {
+            for (const char c : word)
+            {
+                if (classOf[uint8_t(c)] == 0)
+                    classOf[uint8_t(c)] = numClasses++;
+            }
+        }
+        return classOf;
+    }
+
+    static constexpr uint32_t countClasses(const std::array<uint16_t, 256>& classOf)
+    {
+        uint32_t numClasses = 1;
+        for (const uint16_t cls : classOf)
+            numClasses = cls >= numClasses ? cls + 1 : numClasses;
+        return numClasses;
+    }
+
+    // Paths only, 0 where there is no edge. Returns the node count, endpointOf gets each node's key.
+    template <size_t NumKeys>
+    static constexpr uint32_t addPaths(const std::array<std::string_view, NumKeys>& words, const std::array<uint16_t, 256>& classOf,
+                                       uint32_t numClasses, std::vector<uint32_t>& table, std::vector<uint32_t>& endpointOf)
+    {
+        table.assign(numClasses, 0);
+        endpointOf.assign(1, NO_NODE);
+        for (uint32_t key = 0; key < NumKeys; key++)
+        {
+            uint32_t node = 0;
+            for (const char c : words[key])
+            {
+                const size_t edge = size_t(node) * numClasses + classOf[uint8_t(c)];
+                if (table[edge] == 0)
+                {
+                    table[edge] = uint32_t(endpointOf.size());
+                    table.resize(table.size() + numClasses, 0);
+                    endpointOf.push_back(NO_NODE);
+                }
+                node = table[edge];
+            }
+            endpointOf[node] = key; // A later key for the same word wins
+        }
+        return uint32_t(endpointOf.size());
+    }
+
+    template <size_t NumKeys>
+    static constexpr uint32_t countNodes(const std::array<std::string_view, NumKeys>& words, const std::array<uint16_t, 256>& classOf, uint32_t numClasses)
+    {
+        std::vector<uint32_t> table, endpointOf;
+        return addPaths(words, classOf, numClasses, table, endpointOf);
+    }
+
+    template <typename Entry, uint32_t NumNodes, uint32_t NumClasses, size_t NumKeys>
+    static constexpr Tables<Entry, NumNodes, NumClasses> tables(const std::array<std::string_view, NumKeys>& words, const std::array<uint16_t, 256>& classOf,
+                                                               bool ahoCorasick)
+    {
+        std::vector<uint32_t> table, endpointOf;
+        addPaths(words, classOf, NumClasses, table, endpointOf);
+        std::vector<uint32_t> suffixOf(NumNodes, NO_NODE);
+
+        if (ahoCorasick)
+        {
+            std::vector<uint32_t> failOf(NumNodes, 0);
+            std::vector<uint32_t> queue;
+            for (uint32_t cls = 0; cls < NumClasses; cls++)
+            {
+                if (table[cls] != 0)
+                    queue.push_back(table[cls]);
+            }
+            for (size_t i = 0; i < queue.size(); i++)
+            {
+                const uint32_t node = queue[i];
+                const size_t   row  = size_t(node) * NumClasses;
+                const size_t   fail = size_t(failOf[node]) * NumClasses;
+                for (uint32_t cls = 0; cls < NumClasses; cls++)
+                {
+                    if (table[row + cls] == 0)
+                    {
+                        table[row + cls] = table[fail + cls];
+                        continue;
+                    }
+                    const uint32_t child = table[row + cls];
+                    failOf[child]        = table[fail + cls];
+                    suffixOf[child]      = endpointOf[failOf[child]] != NO_NODE ? failOf[child] : suffixOf[failOf[child]];
+                    queue.push_back(child);
+                }
+            }
+        }
+        else
+        {
+            for (size_t node = 1; node < NumNodes; node++)
+            {
+                for (uint32_t cls = 0; cls < NumClasses; cls++)
+                {
+                    if (table[node * NumClasses + cls] == 0)
+                        table[node * NumClasses + cls] = table[cls];
+                }
+            }
+        }
+
+        Tables<Entry, NumNodes, NumClasses> ret;
+        for (size_t i = 0; i < table.size(); i++)
+        {
+            const uint32_t next = table[i];
+            const bool     hit  = endpointOf[next] != NO_NODE || suffixOf[next] != NO_NODE;
+            ret.table[i]        = Entry(next | (hit ? endpointBit<Entry>() : 0));
+        }
+        for (size_t node = 0; node < NumNodes; node++)
+        {
+            ret.endpointOf[node] = endpointOf[node];
+            ret.suffixOf[node]   = suffixOf[node];
+        }
+        return ret;
+    }
+};
+
+template <Trie::Mode Mode, typename... Endpoints>
+class StaticTrie
+{
+public:
+    StaticTrie() {}
+
+    /*------------            Primary Interface             ------------*/
+    void process(const char c)
+    {
+        const Entry next = TABLES.table[m_cur * NUM_CLASSES + CLASS_OF[uint8_t(c)]];
+        m_cur = next & INDEX_MASK;
+        if (next & ENDPOINT_BIT)
+            fire(m_cur);
+    }
+    void process(std::string_view text)
+    {
+        for (const char c : text)
+            process(c);
+    }
+
+    void reset() { m_cur = 0; }
+
+    static constexpr uint32_t numNodes()   { return NUM_NODES; }
+    static constexpr uint32_t numClasses() { return NUM_CLASSES; }
+
+private:
+    /*------------            Generated Tables            ------------*/
+    using Builder = StaticTrieBuilder;
+
+    static constexpr size_t                                 NUM_KEYS    = sizeof...(Endpoints);
+    static constexpr std::array<std::string_view, NUM_KEYS> WORDS       = {Endpoints::word...};
+    static constexpr std::array<uint16_t, 256>              CLASS_OF    = Builder::classes(WORDS);
+    static constexpr uint32_t                               NUM_CLASSES = Builder::countClasses(CLASS_OF);
+    static constexpr uint32_t                               NUM_NODES   = Builder::countNodes(WORDS, CLASS_OF, NUM_CLASSES);
+    static constexpr uint32_t                               NO_NODE     = Builder::NO_NODE;
+
+    // Small command sets get 16 bit transitions, half the cache footprint
+    using Entry = std::conditional_t<(NUM_NODES < 0x8000), uint16_t, uint32_t>;
+    static constexpr Entry ENDPOINT_BIT = Builder::endpointBit<Entry>();
+    static constexpr Entry INDEX_MASK   = Entry(ENDPOINT_BIT - 1);
+
+    static constexpr Builder::Tables<Entry, NUM_NODES, NUM_CLASSES> TABLES =
+        Builder::tables<Entry, NUM_NODES, NUM_CLASSES>(WORDS, CLASS_OF, Mode == Trie::Mode::AhoCorasick);
+
+    /*------------            Dispatch            ------------*/
+    template <size_t... I>
+    static void dispatch(uint32_t key, std::index_sequence<I...>)
+    {
+        // Folds into a switch on key, with each handler called directly
+        (void)((key == I ? (Endpoints::call(), true) : false) || ...);
+    }
+
+    static void fire(uint32_t node)
+    {
+        if (TABLES.endpointOf[node] != NO_NODE)
+            dispatch(TABLES.endpointOf[node], std::make_index_sequence<NUM_KEYS>());
+
+        if constexpr (Mode == Trie::Mode::AhoCorasick)
+        {
+            for (uint32_t suffix = TABLES.suffixOf[node]; suffix != NO_NODE; suffix = TABLES.suffixOf[suffix])
+                dispatch(TABLES.endpointOf[suffix], std::make_index_sequence<NUM_KEYS>());
+        }
+    }
+
+    /*------------            Traversing State             ------------*/
+    uint32_t m_cur = 0;
+};
@@ -0,0 +1,301 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#include "TaskGraph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+
+TaskGraph::TaskGraph(Threadpool::Pool& pool, Policy policy) : mPool(pool), mPolicy(policy), mRecordCosts(false), mPrepared(false), mRanked(false)
+{
+}
+
+void TaskGraph::precede(NodeId before, NodeId after)
+{
+    assert(before < mTasks.size() && after < mTasks.size());
+    mEdges.emplace_back(before, after);
+    mPrepared = false;
+}
+
+void TaskGraph::setCost(NodeId id, double seconds)
+{
+    assert(id < mTasks.size());
+    mCosts[id] = seconds;
+    mRanked    = false;
+}
+
+void TaskGraph::reserve(size_t numNodes, size_t numEdges)
+{
+    mTasks.reserve(numNodes);
+    mCosts.reserve(numNodes);
+    mEdges.reserve(numEdges);
+}
+
+void TaskGraph::clear()
+{
+    mTasks.clear();
+    mCosts.clear();
+    mEdges.clear();
+    mPrepared = false;
+}
+
+void TaskGraph::prepare()
+{
+    const size_t numNodes = mTasks.size();
+
+    // Counting sort the edges by source into flat successor lists, one allocation
+    // in total rather than a vector per node
+    mSuccStart.assign(numNodes + 1, 0);
+    mNumPredecessors.assign(numNodes, 0);
+    for (const auto& edge : mEdges) {
+        mSuccStart[edge.first + 1]++;
+        mNumPredecessors[edge.second]++;
+    }
+    for (size_t i = 0; i < numNodes; ++i) {
+        mSuccStart[i + 1] += mSuccStart[i];
+    }
+
+    mSuccessors.resize(mEdges.size());
+    std::vector<uint32_t> fill(mSuccStart.begin(), mSuccStart.end() - 1);
+    for (const auto& edge : mEdges) {
+        mSuccessors[fill[edge.first]++] = edge.second;
+    }
+
+    mRoots.clear();
+    for (NodeId id = 0; id < numNodes; ++id) {
+        if (mNumPredecessors[id] == 0) {
+            mRoots.push_back(id);
+        }
+    }
+
+    // Kahn's algorithm, a node on a cycle would never become ready and run() would hang
+    std::vector<uint32_t> remaining(mNumPredecessors);
+    std::vector<NodeId>   ready(mRoots);
+    mOrder.clear();
+    mOrder.reserve(numNodes);
+    while (!ready.empty()) {
+        const NodeId id = ready.back();
+        ready.pop_back();
+        mOrder.push_back(id);
+        for (uint32_t i = mSuccStart[id]; i < mSuccStart[id + 1]; ++i) {
+            if (--remaining[mSuccessors[i]] == 0) {
+                ready.push_back(mSuccessors[i]);
+            }
+        }
+    }
+    if (mOrder.size() != numNodes) {
+        throw std::invalid_argument("TaskGraph contains a cycle");
+    }
+
+    mPending.reset(new std::atomic<uint32_t>[numNodes]);
+    mPrepared = true;
+    mRanked   = false;
+}
+
+void TaskGraph::compute_ranks()
+{
+    // Reverse topological order sees every successor before its predecessors
+    mBottomLevel.assign(mTasks.size(), 0.0);
+    mRanks.resize(mTasks.size());
+    for (auto itr = mOrder.rbegin(); itr != mOrder.rend(); ++itr) {
+        const NodeId id      = *itr;
+        double       longest = 0.0;
+        for (uint32_t i = mSuccStart[id]; i < mSuccStart[id + 1]; ++i) {
+            longest = std::max(longest, mBottomLevel[mSuccessors[i]]);
+        }
+        mBottomLevel[id] = std::max(mCosts[id], 0.0) + longest;
+
+        // Offset by one so even a zero cost node stays ahead of unranked jobs
+        mRanks[id] = 1 + int64_t(std::min(mBottomLevel[id] * 1e6, 9e18));
+    }
+    mRanked = true;
+}
+
+double TaskGraph::criticalPathLength()
+{
+    if (!mPrepared) {
+        prepare();
+    }
+    if (!mRanked) {
+        compute_ranks();
+    }
+
+    double ret = 0.0;
+    for (const NodeId id : mRoots) {
+        ret = std::max(ret, mBottomLevel[id]);
+    }
+    return ret;
+}
+
+double TaskGraph::simulate(size_t numWorkers, Policy policy)
+{
+    if (!mPrepared) {
+        prepare();
+    }
+    if (policy == Policy::CriticalPath && !mRanked) {
+        compute_ranks();
+    }
+    numWorkers = std::max<size_t>(numWorkers, 1);
+
+    // Ready nodes, either a stack (newest first) or ordered by bottom level
+    std::vector<NodeId> readyStack;
+    auto byBottomLevel = [this](NodeId a, NodeId b) { return mBottomLevel[a] < mBottomLevel[b]; };
+    std::priority_queue<NodeId, std::vector<NodeId>, decltype(byBottomLevel)> readyQueue(byBottomLevel);
+
+    auto makeReady = [&](NodeId id) {
+        if (policy == Policy::CriticalPath) {
+            readyQueue.push(id);
+        }
+        else {
+            readyStack.push_back(id);
+        }
+    };
+    for (auto itr = mRoots.rbegin(); itr != mRoots.rend(); ++itr) {
+        makeReady(*itr);
+    }
+
+    // Finish time of every node that is running, earliest first
+    using Event = std::pair<double, NodeId>;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> running;
+    std::vector<uint32_t> remaining(mNumPredecessors);
+    size_t                idle = numWorkers;
+    double                now  = 0.0;
+
+    while (true) {
+        while (idle > 0 && !(readyStack.empty() && readyQueue.empty())) {
+            NodeId id;
+            if (policy == Policy::CriticalPath) {
+                id = readyQueue.top();
+                readyQueue.pop();
+            }
+            else {
+                id = readyStack.back();
+                readyStack.pop_back();
+            }
+            running.emplace(now + std::max(mCosts[id], 0.0), id);
+            idle--;
+        }
+
+        if (running.empty()) break;
+
+        const Event finished = running.top();
+        running.pop();
+        now = finished.first;
+        idle++;
+        for (uint32_t i = mSuccStart[finished.second]; i < mSuccStart[finished.second + 1]; ++i) {
+            if (--remaining[mSuccessors[i]] == 0) {
+                makeReady(mSuccessors[i]);
+            }
+        }
+    }
+    return now;
+}
+
+void TaskGraph::run(Threadpool::LoggingFunc loggingFunc)
+{
+    Threadpool::TaskGroup group;
+    run(group, loggingFunc);
+}
+
+void TaskGraph::run(const Threadpool::CancellationToken& token, Threadpool::LoggingFunc loggingFunc)
+{
+    Threadpool::TaskGroup group(token);
+    run(group, loggingFunc);
+}
+
+void TaskGraph::run(Threadpool::TaskGroup& group, Threadpool::LoggingFunc& loggingFunc)
+{
+    if (!mPrepared) {
+        prepare();
+    }
+
+    for (size_t id = 0; id < mTasks.size(); ++id) {
+        mPending[id].store(mNumPredecessors[id], std::memory_order_relaxed);
+    }
+
+    if (mPolicy == Policy::CriticalPath && !mRanked) {
+        compute_ranks();
+    }
+    if (mRecordCosts) {
+        mRanked = false; // The ranks in use stay valid until the next run, which picks up the new costs
+    }
+
+    if (mPolicy == Policy::CriticalPath) {
+        for (const NodeId id : mRoots) {
+            mPool.submitRanked(group, mRanks[id], [this, &group, id]() { execute(id, group); });
+        }
+    }
+    else {
+        // Roots go out in batches, so a very wide graph takes the pool's queue lock
+        // once per batch instead of once per node
+        static const size_t RootBatch = 1024;
+        Threadpool::TaskList batch;
+        batch.reserve(std::min(mRoots.size(), RootBatch));
+        for (size_t i = 0; i < mRoots.size(); ++i) {
+            const NodeId id = mRoots[i];
+            batch.emplace_back([this, &group, id]() { execute(id, group); });
+            if (batch.size() == RootBatch || i + 1 == mRoots.size()) {
+                mPool.submit(group, std::move(batch));
+                batch.clear();
+            }
+        }
+    }
+
+    mPool.join(group, loggingFunc);
+}
+
+void TaskGraph::execute(NodeId id, Threadpool::TaskGroup& group)
+{
+    if (mRecordCosts) {
+        const auto start = std::chrono::steady_clock::now();
+        if (mTasks[id]) {
+            mTasks[id]();
+        }
+        // Only this thread touches this node's cost during the run
+        mCosts[id] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    else if (mTasks[id]) {
+        mTasks[id]();
+    }
+    release_successors(id, group);
+}
+
+void TaskGraph::release_successors(NodeId id, Threadpool::TaskGroup& group)
+{
+    for (uint32_t i = mSuccStart[id]; i < mSuccStart[id + 1]; ++i) {
+        const NodeId succ = mSuccessors[i];
+
+        // acq_rel so the successor sees everything every one of its predecessors wrote
+        if (mPending[succ].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (mPolicy == Policy::CriticalPath) {
+                mPool.submitRanked(group, mRanks[succ], [this, &group, succ]() { execute(succ, group); });
+            }
+            else {
+                mPool.submit(group, [this, &group, succ]() { execute(succ, group); });
+            }
+        }
+    }
+}
@@ -0,0 +1,128 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include "InplaceTask.h"
+#include "Threadpool.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Dependency graph of tasks, executed on a Threadpool::Pool.
+//
+// Every node keeps an atomic count of its unfinished predecessors. When a node finishes it
+// decrements the count of each successor, and whichever predecessor brings a count to zero
+// submits that successor. The ready frontier therefore goes straight onto the pool and no
+// thread ever waits on an unfinished parent.
+//
+// A node that throws cancels the run: nodes that haven't started yet are skipped without
+// running, and run() rethrows the first exception once the running ones have finished.
+//
+// With Policy::CriticalPath every node is ranked by its bottom level, the cost of the longest
+// path from the node to the end of the graph. Ready nodes on the longest chains run first, so
+// those chains don't start late and end up defining the makespan. Costs are estimates given to
+// setCost(), or the runtimes measured by a previous run() with recordCosts(true).
+class TaskGraph
+{
+public:
+    using NodeId = uint32_t;
+
+    enum class Policy { Depth,         // The pool's usual order, children of running nodes first
+                        CriticalPath };
+
+    static constexpr double DefaultCost = 1.0; // Seconds, for nodes without an estimate yet
+
+    explicit TaskGraph(Threadpool::Pool& pool = Threadpool::pool(), Policy policy = Policy::Depth);
+
+    TaskGraph(const TaskGraph&)            = delete;
+    TaskGraph& operator=(const TaskGraph&) = delete;
+
+    // The callable stays in the graph and is invoked again on every run()
+    template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+    NodeId add(F&& func)
+    {
+        mTasks.emplace_back(std::forward<F>(func));
+        mCosts.push_back(DefaultCost);
+        mPrepared = false;
+        return NodeId(mTasks.size() - 1);
+    }
+
+    void precede(NodeId before, NodeId after); // after only starts once before has finished
+    void reserve(size_t numNodes, size_t numEdges);
+    void clear();
+
+    size_t num_nodes() const { return mTasks.size(); }
+    size_t num_edges() const { return mEdges.size(); }
+
+    void   setPolicy(Policy policy) { mPolicy = policy; }
+    Policy policy() const           { return mPolicy; }
+
+    void   setCost(NodeId id, double seconds);
+    double cost(NodeId id) const { return mCosts[id]; }
+    void   recordCosts(bool record) { mRecordCosts = record; } // Replace each node's cost with its measured runtime on every run()
+
+    double criticalPathLength(); // Longest path through the graph by cost, a lower bound on the makespan
+
+    // Replays the graph on numWorkers idealised workers using the current costs, and returns the
+    // makespan in seconds. Policy::Depth models the pool's default order, where a worker picks up
+    // the most recently released node first. Meant for comparing policies on recorded graphs.
+    double simulate(size_t numWorkers, Policy policy);
+
+    // Executes the whole graph and returns once every reachable node has finished. The calling
+    // thread helps out on the pool meanwhile. Throws std::invalid_argument if the graph has a cycle.
+    // A graph can be run any number of times, but not by two threads at once.
+    void run(Threadpool::LoggingFunc loggingFunc = Threadpool::LoggingFunc());
+    // Same, but cancelling the token stops the run early, with no exception
+    void run(const Threadpool::CancellationToken& token, Threadpool::LoggingFunc loggingFunc = Threadpool::LoggingFunc());
+
+private:
+    void prepare(); // Builds the successor lists and checks for cycles, once per change to the graph
+    void compute_ranks(); // Bottom levels from the current costs
+    void run(Threadpool::TaskGroup& group, Threadpool::LoggingFunc& loggingFunc);
+    void execute(NodeId id, Threadpool::TaskGroup& group);
+    void release_successors(NodeId id, Threadpool::TaskGroup& group);
+
+    Threadpool::Pool&                          mPool;
+    Policy                                     mPolicy;
+    bool                                       mRecordCosts;
+    std::vector<InplaceTask>                   mTasks;
+    std::vector<double>                        mCosts;        // Seconds, per node
+    std::vector<std::pair<NodeId, NodeId>>     mEdges;        // As added, before/after
+
+    // Built by prepare()
+    bool                                       mPrepared;
+    std::vector<uint32_t>                      mSuccStart;    // Successors of n are mSuccessors[mSuccStart[n], mSuccStart[n + 1])
+    std::vector<NodeId>                        mSuccessors;
+    std::vector<uint32_t>                      mNumPredecessors;
+    std::vector<NodeId>                        mRoots;
+    std::vector<NodeId>                        mOrder;        // Topological
+    std::unique_ptr<std::atomic<uint32_t>[]>   mPending;      // Unfinished predecessors, reset at the start of each run
+
+    // Built by compute_ranks()
+    bool                                       mRanked;
+    std::vector<double>                        mBottomLevel;  // Seconds
+    std::vector<int64_t>                       mRanks;        // Bottom level in microseconds, for Pool::submitRanked
+};
@@ -23,194 +23,643 @@
 
 //#include "Logger.h"
 #include "Threadpool.h"
+#include "CpuTopology.h"
 #include <cassert>
+#include <future>
+
+#ifdef _WIN32
+#include <process.h>
+#include <windows.h>
+#else
+#include <climits>
+#include <pthread.h>
+#endif
 
 #define ALLOW_THREADED 1
+#define THREADPOOL_WORK_STEALING 0 // 1 moves the registry's compute and I/O pools onto the work-stealing scheduler
 
 // The thread priority lets us increase priority of any
 // child tasks, so that we don't explode the number of tasks in flight
 // before actually doing any work.
 static thread_local int threadPriority = 0;
 
-Threadpool::Threadpool(unsigned int nThreads) : mbStopnow(false), mNumJobsSent(0), mNumJobsComplete(0)
+// Which pool and deque the current thread works for, only set on worker threads
+static thread_local Threadpool::Pool* workerPool  = nullptr;
+static thread_local size_t      workerIndex = 0;
+
+// Joining threads sleep on wakeEpoch, which only changes while numWaiters > 0.
+// It is shared by every pool since a joiner can be waiting on another pool's work.
+static std::atomic<uint32_t> numWaiters(0);
+static std::atomic<uint32_t> wakeEpoch(0);
+
+namespace {
+    // Recycles Jobs so steady-state submission never touches the heap.
+    // Each thread keeps a small free list, and spills to or refills from a shared
+    // list in batches so the mutex is only taken once every JobBatch jobs.
+    // Jobs tend to be allocated on the submitting thread and released on whichever
+    // thread drops the last reference, so the shared list is what balances the two.
+    template <typename JobT>
+    class JobPool
+    {
+    public:
+        static const size_t JobBatch = 256;
+
+        static JobPool& global()
+        {
+            static JobPool pool;
+            return pool;
+        }
+
+        ~JobPool()
+        {
+            freeList(mShared);
+        }
+
+        JobT* take()
+        {
+            if (localListDestroyed()) return new JobT(); // Thread is exiting
+
+            Local& local = localList();
+            if (!local.head) {
+                std::unique_lock<std::mutex> lock(mMutex);
+                // Grab up to a batch from the shared list
+                size_t cnt = 0;
+                while (mShared && cnt < JobBatch) {
+                    JobT* job  = mShared;
+                    mShared    = job->next;
+                    job->next  = local.head;
+                    local.head = job;
+                    ++cnt;
+                }
+                local.count = cnt;
+            }
+
+            if (local.head) {
+                JobT* job  = local.head;
+                local.head = job->next;
+                --local.count;
+                return job;
+            }
+            return new JobT();
+        }
+
+        void give(JobT* job)
+        {
+            if (localListDestroyed()) { // Thread is exiting
+                delete job;
+                return;
+            }
+
+            Local& local = localList();
+            job->next    = local.head;
+            local.head   = job;
+            ++local.count;
+
+            if (local.count >= 2 * JobBatch) {
+                // Hand a batch back so the submitting threads can reuse it
+                JobT* batchHead = local.head;
+                JobT* batchTail = local.head;
+                for (size_t i = 1; i < JobBatch; ++i) {
+                    batchTail = batchTail->next;
+                }
+                local.head   = batchTail->next;
+                local.count -= JobBatch;
+
+                std::unique_lock<std::mutex> lock(mMutex);
+                batchTail->next = mShared;
+                mShared         = batchHead;
+            }
+        }
+
+    private:
+        struct Local {
+            JobT*  head  = nullptr;
+            size_t count = 0;
+
+            ~Local()
+            {
+                freeList(head);
+                localListDestroyed() = true;
+            }
+        };
+
+        static Local& localList()
+        {
+            static thread_local Local local;
+            return local;
+        }
+
+        // Jobs can still be released while thread_locals are being torn down
+        static bool& localListDestroyed()
+        {
+            static thread_local bool destroyed = false;
+            return destroyed;
+        }
+
+        static void freeList(JobT* head)
+        {
+            while (head) {
+                JobT* next = head->next;
+                delete head;
+                head = next;
+            }
+        }
+
+        std::mutex mMutex;
+        JobT*      mShared = nullptr;
+    };
+}
+
+// Workers are started natively since std::thread has no way to pick a stack size
+struct Threadpool::Pool::WorkerThread
 {
+    Pool*  pool;
+    size_t index;
+#ifdef _WIN32
+    HANDLE handle = nullptr;
+
+    static unsigned __stdcall entry(void* arg)
+    {
+        auto self = static_cast<WorkerThread*>(arg);
+        self->pool->infinite_loop(self->index);
+        return 0;
+    }
+#else
+    pthread_t handle;
+    bool      started = false;
+
+    static void* entry(void* arg)
+    {
+        auto self = static_cast<WorkerThread*>(arg);
+        self->pool->infinite_loop(self->index);
+        return nullptr;
+    }
+#endif
+
+    WorkerThread(Pool* p, size_t i) : pool(p), index(i) {}
+
+    bool start(size_t stackSize)
+    {
+#ifdef _WIN32
+        handle = reinterpret_cast<HANDLE>(_beginthreadex(nullptr, unsigned(stackSize), &WorkerThread::entry, this, 0, nullptr));
+        return handle != nullptr;
+#else
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (stackSize > 0) {
+            pthread_attr_setstacksize(&attr, std::max(stackSize, size_t(PTHREAD_STACK_MIN)));
+        }
+        started = pthread_create(&handle, &attr, &WorkerThread::entry, this) == 0;
+        pthread_attr_destroy(&attr);
+        return started;
+#endif
+    }
+
+    bool joinable() const
+    {
+#ifdef _WIN32
+        return handle != nullptr;
+#else
+        return started;
+#endif
+    }
+
+    void join()
+    {
+#ifdef _WIN32
+        WaitForSingleObject(handle, INFINITE);
+        CloseHandle(handle);
+        handle = nullptr;
+#else
+        pthread_join(handle, nullptr);
+        started = false;
+#endif
+    }
+};
+
+Threadpool::Pool::Pool(const Config& config) : mConfig(config), mMode(config.mode), mbStopnow(false), mNumJobsSent(0), mNumJobsComplete(0), mNumQueued(0), mNumSleeping(0)
+{
+    JobPool<Job>::global(); // Constructed first so it outlives the pool and any jobs it drops in shutdown(). Too late for the registry's pools, PoolRegistry::get() sees to those
+
     const uint32_t hardThreads    = std::thread::hardware_concurrency();
     uint32_t       poolThreads    = 0; // Default to single-threaded mode
-    const auto numThreadsReserved = 4; // We don't want to render the system unusable
+    const auto numThreadsReserved = mConfig.reservedCores;
 
 #if ALLOW_THREADED
     if (hardThreads > numThreadsReserved) {
-        poolThreads = std::clamp(nThreads, 0u, hardThreads - numThreadsReserved);
+        poolThreads = std::clamp(mConfig.numThreads, 0u, hardThreads - numThreadsReserved);
     }
 #endif
 
+    place_workers(poolThreads);
+
+    // Deques must all exist before any worker can try to steal from them
+    if (mMode == SchedulerMode::WorkStealing) {
+        for (unsigned int i=0; i < poolThreads; ++i) {
+            mDeques.push_back(std::make_unique<WorkerDeque>());
+        }
+    }
+
     for (unsigned int i=0; i < poolThreads; ++i) {
-        mPool.push_back(std::thread(&Threadpool::infinite_loop,this));
+        auto worker = std::make_unique<WorkerThread>(this, size_t(i));
+        if (!worker->start(mConfig.stackSize)) break; // Run with what we have, joiners pick up the slack
+        mPool.push_back(move(worker));
     }
 }
 
-Threadpool::~Threadpool()
+Threadpool::Pool::Pool() : Pool(Config())
 {
-    shutdown();
 }
 
+void Threadpool::Pool::place_workers(size_t numWorkers)
+{
+    const auto& nodes    = CpuTopology::system().nodes();
+    const bool  useNodes = mConfig.numaAware && mMode == SchedulerMode::WorkStealing && nodes.size() > 1;
+
+    mWorkerNode.assign(numWorkers, 0);
+    mWorkerCpu.assign(numWorkers, -1);
+    for (size_t i = 0; i < numWorkers; ++i) {
+        mAllWorkers.push_back(i);
+    }
+
+    if (!mConfig.pinWorkers && !useNodes) return;
+
+    // Only the CPUs the process may run on (taskset, cgroups, a container's cpuset), less the
+    // reserved cores. Those are the lowest numbered, where the OS does most of its own work.
+    std::vector<unsigned> allowed = CpuTopology::allowedCpus();
+    if (allowed.empty()) {
+        for (const auto& node : nodes) {
+            allowed.insert(allowed.end(), node.cpus.begin(), node.cpus.end());
+        }
+        std::sort(allowed.begin(), allowed.end());
+    }
+    if (allowed.size() > mConfig.reservedCores) {
+        allowed.erase(allowed.begin(), allowed.begin() + mConfig.reservedCores);
+    }
 
-Threadpool& Threadpool::instance()
+    mNodeCpus.assign(nodes.size(), {});
+    size_t numCpus = 0;
+    for (size_t nodeIdx = 0; nodeIdx < nodes.size(); ++nodeIdx) {
+        for (const unsigned cpu : nodes[nodeIdx].cpus) {
+            if (std::binary_search(allowed.begin(), allowed.end(), cpu)) {
+                mNodeCpus[nodeIdx].push_back(cpu);
+                numCpus++;
+            }
+        }
+    }
+    if (numCpus == 0) return; // The topology and the affinity mask disagree, leave the workers to the OS
+
+    // Deal the CPUs out one node at a time, so that however many workers we
+    // have they are split evenly across the sockets
+    std::vector<std::pair<size_t, unsigned>> slots; // Node index, CPU
+    for (size_t round = 0; slots.size() < numCpus; ++round) {
+        for (size_t nodeIdx = 0; nodeIdx < nodes.size(); ++nodeIdx) {
+            if (round < mNodeCpus[nodeIdx].size()) {
+                slots.emplace_back(nodeIdx, mNodeCpus[nodeIdx][round]);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < numWorkers; ++i) {
+        const auto& slot = slots[i % slots.size()];
+        mWorkerNode[i]   = useNodes ? slot.first : 0;
+        mWorkerCpu[i]    = mConfig.pinWorkers ? int(slot.second) : -1;
+    }
+
+    if (useNodes) {
+        mNodeWorkers.resize(nodes.size());
+        for (size_t nodeIdx = 0; nodeIdx < nodes.size(); ++nodeIdx) {
+            mNodeQueues.push_back(std::make_unique<NodeQueue>());
+        }
+        for (size_t i = 0; i < numWorkers; ++i) {
+            mNodeWorkers[mWorkerNode[i]].push_back(i);
+        }
+    }
+}
+
+void Threadpool::Pool::pin_worker(size_t index)
 {
-    static Threadpool local;
-    return local;
+    if (mWorkerCpu[index] >= 0) {
+        CpuTopology::pinCurrentThread({ unsigned(mWorkerCpu[index]) });
+    }
+    else if (!mNodeQueues.empty()) {
+        // Free to move between the cores of its node, but not off it
+        CpuTopology::pinCurrentThread(mNodeCpus[mWorkerNode[index]]);
+    }
+    // A refused affinity isn't fatal, the worker just floats like before
 }
 
-Threadpool::Waitable Threadpool::submit(Task job, bool threaded)
+Threadpool::Pool::~Pool()
 {
-    std::future<void> ret;
-    if (job) {
-        auto task = std::packaged_task<void()>(job);
-        ret = task.get_future();
+    shutdown();
+}
 
-        Threadpool& t = instance();
-        if (threaded) {
-            {
-                std::unique_lock<std::mutex> lock(t.mQMutex);
-                t.mQJobs.emplace(make_pair(threadPriority, move(task)));
-                t.mNumJobsSent.fetch_add(1);
+namespace {
+    Threadpool::Config defaultConfig(Threadpool::PoolId id)
+    {
+        Threadpool::Config config;
+#if THREADPOOL_WORK_STEALING
+        config.mode = Threadpool::SchedulerMode::WorkStealing;
+#endif
+        switch (id) {
+        case Threadpool::PoolId::IO:
+            // Mostly blocked in the kernel, so it doesn't need cores set aside
+            config.name          = "io";
+            config.numThreads    = 8;
+            config.reservedCores = 0;
+            break;
+        case Threadpool::PoolId::Control:
+            config.name          = "control";
+            config.numThreads    = 2;
+            config.reservedCores = 0;
+            config.mode          = Threadpool::SchedulerMode::PriorityQueue;
+            break;
+        default:
+            break;
+        }
+        return config;
+    }
+
+    struct PoolRegistry {
+        std::mutex                                                              mutex;
+        std::atomic<Threadpool::Pool*>                                          pools[size_t(Threadpool::PoolId::Count)] = {};
+        std::unique_ptr<Threadpool::Pool>                                       owned[size_t(Threadpool::PoolId::Count)];
+        std::unique_ptr<Threadpool::Config>                                     configs[size_t(Threadpool::PoolId::Count)];
+
+        // Statics are destroyed in reverse order of construction, and the registry exists before
+        // any of its pools. So the JobPool is touched first here, or it would go before the pools.
+        template <typename JobT>
+        static PoolRegistry& get()
+        {
+            JobPool<JobT>::global();
+            static PoolRegistry registry;
+            return registry;
+        }
+
+        ~PoolRegistry()
+        {
+            // Compute work may still be feeding the I/O pool, so take it down first
+            for (auto& pool : owned) {
+                pool.reset();
             }
-            t.mJobAlert.notify_one();
         }
-        else {
-            t.mNumJobsSent.fetch_add(1);
-            task();
-            t.mNumJobsComplete.fetch_add(1);
+    };
+}
+
+Threadpool::Pool& Threadpool::pool(PoolId id)
+{
+    PoolRegistry& registry = PoolRegistry::get<Job>();
+    const size_t  idx      = size_t(id);
+    assert(idx < size_t(PoolId::Count));
+
+    Pool* ret = registry.pools[idx].load(std::memory_order_acquire);
+    if (!ret) {
+        std::unique_lock<std::mutex> lock(registry.mutex);
+        ret = registry.pools[idx].load(std::memory_order_relaxed);
+        if (!ret) {
+            const Config config = registry.configs[idx] ? *registry.configs[idx] : defaultConfig(id);
+            registry.owned[idx] = std::make_unique<Pool>(config);
+            ret                 = registry.owned[idx].get();
+            registry.pools[idx].store(ret, std::memory_order_release);
         }
     }
+    return *ret;
+}
 
-    return ret;
+bool Threadpool::configure(PoolId id, const Config& config)
+{
+    PoolRegistry& registry = PoolRegistry::get<Job>();
+    const size_t  idx      = size_t(id);
+    assert(idx < size_t(PoolId::Count));
+
+    std::unique_lock<std::mutex> lock(registry.mutex);
+    if (registry.pools[idx].load()) return false; // Too late, it's already running
+
+    registry.configs[idx] = std::make_unique<Config>(config);
+    return true;
 }
 
 Threadpool::WaitableList Threadpool::submit(TaskList job_list, bool threaded)
 {
-    std::vector<std::future<void>> ret;
-    std::vector<std::packaged_task<void()>> tasks;
+    return pool().submit(std::move(job_list), threaded);
+}
+
+void Threadpool::submit(TaskGroup& group, TaskList job_list, bool threaded)
+{
+    pool().submit(group, std::move(job_list), threaded);
+}
+
+void Threadpool::join(LoggingFunc loggingFunc)
+{
+    pool().join(loggingFunc);
+}
+
+void Threadpool::join(Waitable&& waitable, LoggingFunc loggingFunc)
+{
+    pool().join(std::move(waitable), loggingFunc);
+}
+
+void Threadpool::join(WaitableList&& waitables, LoggingFunc loggingFunc)
+{
+    pool().join(std::move(waitables), loggingFunc);
+}
+
+void Threadpool::join(TaskGroup& group, LoggingFunc loggingFunc)
+{
+    pool().join(group, loggingFunc);
+}
+
+void Threadpool::submitAndJoin(TaskList job_list, bool threaded, LoggingFunc loggingFunc, size_t inFlightLimit)
+{
+    pool().submitAndJoin(std::move(job_list), threaded, loggingFunc, inFlightLimit);
+}
+
+Threadpool::Waitable Threadpool::Pool::submit_task(InplaceTask&& func, bool threaded, int numaNode)
+{
+    Waitable ret;
+    if (func) {
+        Job* job = alloc_job(std::move(func), nullptr, 2, this);
+        ret = Waitable(job);
+        schedule(job, threaded, numaNode);
+    }
+
+    return ret;
+}
+
+void Threadpool::Pool::submit_task(TaskGroup& group, InplaceTask&& func, bool threaded, int numaNode, int64_t rank)
+{
+    if (func) {
+        group.mPending.fetch_add(1);
+        group.mSubmitted.fetch_add(1);
+        Job* job  = alloc_job(std::move(func), &group, 1, this);
+        job->rank = rank;
+        schedule(job, threaded, numaNode);
+    }
+}
+
+Threadpool::WaitableList Threadpool::Pool::submit(TaskList job_list, bool threaded)
+{
+    WaitableList      ret;
+    std::vector<Job*> jobs;
     ret.reserve(job_list.size());
-    tasks.reserve(job_list.size());
+    jobs.reserve(job_list.size());
 
     for (auto& job : job_list) {
         if (job) {
-            tasks.emplace_back(job);
-            ret.emplace_back(tasks.back().get_future());
+            // Moved, not copied, into the job's inline storage
+            jobs.emplace_back(alloc_job(InplaceTask(std::move(job)), nullptr, 2, this));
+            ret.emplace_back(Waitable(jobs.back()));
         }
     }
 
-    Threadpool& t = instance();
-    if (threaded) {
-        size_t numTasks = tasks.size();
-        {
-            std::unique_lock<std::mutex> lock(t.mQMutex);
-            for (auto& task : tasks) {
-                t.mQJobs.emplace(make_pair(threadPriority, move(task)));
-            }
-            t.mNumJobsSent.fetch_add(tasks.size());
+    schedule(jobs, threaded);
+    return ret;
+}
+
+void Threadpool::Pool::submit(TaskGroup& group, TaskList job_list, bool threaded)
+{
+    std::vector<Job*> jobs;
+    jobs.reserve(job_list.size());
+
+    for (auto& job : job_list) {
+        if (job) {
+            jobs.emplace_back(alloc_job(InplaceTask(std::move(job)), &group, 1, this));
         }
-        t.mJobAlert.notify_all(); // Might send some unlucky threads right back to sleep without grabbing work?
     }
-    else {
-        t.mNumJobsSent.fetch_add(tasks.size());
-        for (auto& task : tasks) {
-            task();
-            t.mNumJobsComplete.fetch_add(1);
+
+    // Count them all before any can run and finish
+    group.mPending.fetch_add(jobs.size());
+    group.mSubmitted.fetch_add(jobs.size());
+    schedule(jobs, threaded);
+}
+
+void Threadpool::Pool::schedule(Job* job, bool threaded, int numaNode)
+{
+    if (threaded && numaNode >= 0 && !mNodeQueues.empty()) {
+        const int nodeIdx = CpuTopology::system().nodeIndex(numaNode);
+
+        // A worker already on that node keeps the job on its own deque below
+        const bool onNode = workerPool == this && int(mWorkerNode[workerIndex]) == nodeIdx;
+        if (nodeIdx >= 0 && !mNodeWorkers[nodeIdx].empty() && !onNode) {
+            NodeQueue& queue = *mNodeQueues[nodeIdx];
+            mNumJobsSent.fetch_add(1);
+            {
+                std::unique_lock<std::mutex> lock(queue.mutex);
+                queue.jobs.push_back(job);
+                queue.size.fetch_add(1);
+            }
+            mNumQueued.fetch_add(1);
+            wake_workers(2); // All of them, a single notify could land on another node
+            notify_waiters();
+            return;
         }
     }
 
-    return ret;
+    if (threaded && mMode == SchedulerMode::WorkStealing) {
+        mNumJobsSent.fetch_add(1);
+        enqueue(job);
+    }
+    else if (threaded) {
+        {
+            std::unique_lock<std::mutex> lock(mQMutex);
+            mQJobs.emplace(job);
+            mNumJobsSent.fetch_add(1);
+            mNumQueued.fetch_add(1);
+        }
+        mJobAlert.notify_one();
+        notify_waiters();
+    }
+    else {
+        mNumJobsSent.fetch_add(1);
+        run_job(job);
+        mNumJobsComplete.fetch_add(1);
+        notify_waiters();
+    }
 }
 
-void Threadpool::submitAndJoin(Task job, bool threaded, LoggingFunc loggingFunc, size_t inFlightLimit)
+void Threadpool::Pool::schedule(std::vector<Job*>& jobs, bool threaded)
 {
-    if (inFlightLimit == SIZE_MAX) {
-        join(submit(std::move(job), threaded), loggingFunc);
+    if (threaded && mMode == SchedulerMode::WorkStealing) {
+        mNumJobsSent.fetch_add(jobs.size());
+        enqueue(jobs);
+    }
+    else if (threaded) {
+        {
+            std::unique_lock<std::mutex> lock(mQMutex);
+            for (auto job : jobs) {
+                mQJobs.emplace(job);
+            }
+            mNumJobsSent.fetch_add(jobs.size());
+            mNumQueued.fetch_add(jobs.size());
+        }
+        mJobAlert.notify_all(); // Might send some unlucky threads right back to sleep without grabbing work?
+        notify_waiters();
     }
     else {
-        Threadpool& t = instance();
-        t.waitForInFlight(inFlightLimit);
-        join(submit(std::move(job), threaded), loggingFunc);
+        mNumJobsSent.fetch_add(jobs.size());
+        for (auto job : jobs) {
+            run_job(job);
+            mNumJobsComplete.fetch_add(1);
+            notify_waiters();
+        }
     }
 }
 
-void Threadpool::submitAndJoin(TaskList job_list, bool threaded, LoggingFunc loggingFunc, size_t inFlightLimit)
+void Threadpool::Pool::submitAndJoin(TaskList job_list, bool threaded, LoggingFunc loggingFunc, size_t inFlightLimit)
 {
+    TaskGroup group;
     if (inFlightLimit == SIZE_MAX) {
-        join(submit(std::move(job_list), threaded), loggingFunc);
+        submit(group, std::move(job_list), threaded);
     }
     else {
-        size_t totalJobs        = job_list.size();
-        size_t lastSeenComplete = 0;
-        auto   startTime        = std::chrono::high_resolution_clock::now();
+        const size_t totalJobs        = job_list.size();
+        size_t       lastSeenComplete = 0;
+        auto         startTime        = std::chrono::high_resolution_clock::now();
 
-        WaitableList endWaitables;
-        Threadpool& t = instance();
         for (auto taskItr = job_list.begin(); taskItr != job_list.end(); taskItr++) {
-            t.waitForInFlight(inFlightLimit);
-            endWaitables.emplace_back(submit(std::move(*taskItr), threaded));
+            waitForInFlight(inFlightLimit);
 
-            // Find those that are done
-            size_t newComplete = 0;
-            for (auto eraseItr = std::begin(endWaitables); eraseItr != std::end(endWaitables);) {
-                if (!eraseItr->valid() || is_ready(*eraseItr)) {
-                    newComplete++;
-                    eraseItr->get(); // This should return void, or throw an exception
+            // Stop feeding the pool once something has failed, join() below will rethrow it
+            if (group.cancelled()) break;
 
-                    eraseItr = endWaitables.erase(eraseItr);
-                }
-                else {
-                    eraseItr++;
-                }
-            }
+            submit(group, std::move(*taskItr), threaded);
 
             // If any completed while we were doing work, log that some completed
-            if (loggingFunc && newComplete) {
+            const size_t curComplete = group.submitted() - group.pending();
+            if (loggingFunc && curComplete != lastSeenComplete) {
                 auto endTime         = std::chrono::high_resolution_clock::now();
                 auto timeSinceUpdate = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
 
-                lastSeenComplete += newComplete;
+                loggingFunc(totalJobs - curComplete, curComplete - lastSeenComplete, timeSinceUpdate.count());
 
-                loggingFunc(totalJobs - lastSeenComplete, newComplete, timeSinceUpdate.count());
-
-                startTime = std::chrono::high_resolution_clock::now();
+                lastSeenComplete = curComplete;
+                startTime        = std::chrono::high_resolution_clock::now();
             }
         }
-
-        join(std::move(endWaitables), loggingFunc);
     }
+
+    join(group, loggingFunc);
 }
 
-void Threadpool::join(LoggingFunc loggingFunc)
+void Threadpool::Pool::join(LoggingFunc loggingFunc)
 {
-    Threadpool& t = instance();
-
-    int    timeout          = 0;
-    size_t lastSeenComplete = t.mNumJobsComplete.load();
+    size_t lastSeenComplete = mNumJobsComplete.load();
     auto   startTime        = std::chrono::high_resolution_clock::now();
+    const bool allowLongWork = loggingFunc ? false : true;
     // While we wait, this thread can also act as a worker thread
-    // unless there's no work to do, in which case we'll spin-lock
-    while (t.mNumJobsSent.load() > t.mNumJobsComplete.load()) {
-        if (timeout <= 0) {
-            if (!t.do_work_nonblocking(loggingFunc ? false : true)) {
-                // There wasn't work, so back off for a bit and then try again
-                timeout = TimeoutReset;
-            }
-        }
-        else {
-            std::this_thread::yield(); // Spin lock while waiting for another thread to complete
-            --timeout;
+    // unless there's no work to do, in which case we'll spin and then sleep
+    while (mNumJobsSent.load() > mNumJobsComplete.load()) {
+        if (!do_work_nonblocking(allowLongWork)) {
+            idle_wait([this]() { return mNumJobsSent.load() <= mNumJobsComplete.load(); }, allowLongWork);
         }
 
-        if (loggingFunc && (t.mNumJobsComplete.load() != lastSeenComplete)) {
+        if (loggingFunc && (mNumJobsComplete.load() != lastSeenComplete)) {
             auto endTime         = std::chrono::high_resolution_clock::now();
             auto timeSinceUpdate = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
 
-            const size_t curComplete  = t.mNumJobsComplete.load();
+            const size_t curComplete  = mNumJobsComplete.load();
             const size_t diffComplete = curComplete - lastSeenComplete;
-            const size_t leftToFinish = t.mNumJobsSent - curComplete;
+            const size_t leftToFinish = mNumJobsSent - curComplete;
 
             loggingFunc(leftToFinish, diffComplete, timeSinceUpdate.count());
 
@@ -218,27 +667,26 @@ void Threadpool::join(LoggingFunc loggingFunc)
             startTime        = std::chrono::high_resolution_clock::now();
         }
     }
+
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lock(mErrorMutex);
+        std::swap(error, mUnobservedError);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
 }
 
-void Threadpool::join(Waitable&& waitable, LoggingFunc loggingFunc)
+void Threadpool::Pool::join(Waitable&& waitable, LoggingFunc loggingFunc)
 {
-    Threadpool& t = instance();
-
-    int    timeout          = 0;
-    size_t lastSeenComplete = t.mNumJobsComplete.load();
+    size_t lastSeenComplete = mNumJobsComplete.load();
     auto   startTime        = std::chrono::high_resolution_clock::now();
     // While we wait, this thread can also act as a worker thread
-    // unless there's no work to do, in which case we'll spin-lock
+    // unless there's no work to do, in which case we'll spin and then sleep
     while (waitable.valid() && !is_ready(waitable)) {
-        if (timeout <= 0) {
-            if (!t.do_work_nonblocking(false)) {
-                // There wasn't work, so back off for a bit and then try again
-                timeout = TimeoutReset;
-            }
-        }
-        else {
-            std::this_thread::yield(); // Spin lock while waiting for another thread to complete
-            --timeout;
+        if (!do_work_nonblocking(false)) {
+            idle_wait([&waitable]() { return is_ready(waitable); }, false);
         }
     }
 
@@ -259,45 +707,32 @@ void Threadpool::join(Waitable&& waitable, LoggingFunc loggingFunc)
     waitable.get(); // This should return void, or throw an exception
 }
 
-void Threadpool::join(WaitableList&& waitables, LoggingFunc loggingFunc)
+void Threadpool::Pool::join(WaitableList&& waitables, LoggingFunc loggingFunc)
 {
-    Threadpool& t = instance();
-
-    size_t totalJobs        = waitables.size();
-    int    timeout          = 0;
     auto   startTime        = std::chrono::high_resolution_clock::now();
+    const bool allowLongWork = loggingFunc ? false : true;
 
     // We'd normally start waiting in the back as we'd expect those to complete closer to last,
     // but because we're logging, we want to track the progress of which waitable is available,
-    // so we start from the beginning
-    while (!waitables.empty()) {
+    // so we start from the beginning. Each waitable is only ever checked while it is at the
+    // front, so the whole join is linear in the number of waitables.
+    auto front = waitables.begin();
+    while (front != waitables.end()) {
         // While we wait, this thread can also act as a worker thread
-        // unless there's no work to do, in which case we'll spin-lock
-        if (waitables.front().valid() && !is_ready(waitables.front())) {
-            if (timeout <= 0) {
-                if (!t.do_work_nonblocking(loggingFunc ? false : true)) {
-                    // There wasn't work, so back off for a bit and then try again
-                    timeout = TimeoutReset;
-                }
-            }
-            else {
-                std::this_thread::yield(); // Spin lock while waiting for another thread to complete
-                --timeout;
+        // unless there's no work to do, in which case we'll spin and then sleep
+        if (front->valid() && !is_ready(*front)) {
+            if (!do_work_nonblocking(allowLongWork)) {
+                Waitable& waitable = *front;
+                idle_wait([&waitable]() { return is_ready(waitable); }, allowLongWork);
             }
         }
 
-        // Find those that are done
+        // Move past everything at the front that is done
         size_t newComplete = 0;
-        for (auto eraseItr = std::begin(waitables); eraseItr != std::end(waitables);) {
-            if (!eraseItr->valid() || is_ready(*eraseItr)) {
-                newComplete++;
-                eraseItr->get(); // This should return void, or throw an exception
-
-                eraseItr = waitables.erase(eraseItr);
-            }
-            else {
-                eraseItr++;
-            }
+        while (front != waitables.end() && (!front->valid() || is_ready(*front))) {
+            newComplete++;
+            front->get(); // This should return void, or throw an exception
+            ++front;
         }
 
         // If any completed while we were doing work, log that some completed
@@ -305,76 +740,240 @@ void Threadpool::join(WaitableList&& waitables, LoggingFunc loggingFunc)
             auto endTime         = std::chrono::high_resolution_clock::now();
             auto timeSinceUpdate = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
 
-            loggingFunc(waitables.size(), newComplete, timeSinceUpdate.count());
+            loggingFunc(size_t(std::distance(front, waitables.end())), newComplete, timeSinceUpdate.count());
 
             startTime = std::chrono::high_resolution_clock::now();
         }
     }
+    waitables.clear();
+}
+
+void Threadpool::Pool::join(TaskGroup& group, LoggingFunc loggingFunc)
+{
+    size_t lastSeenComplete = group.submitted() - group.pending();
+    auto   startTime        = std::chrono::high_resolution_clock::now();
+    const bool allowLongWork = loggingFunc ? false : true;
+    // While we wait, this thread can also act as a worker thread
+    // unless there's no work to do, in which case we'll spin and then sleep
+    while (!group.done()) {
+        if (!do_work_nonblocking(allowLongWork)) {
+            idle_wait([&group]() { return group.done(); }, allowLongWork);
+        }
+
+        // Progress is just the group's counter, no need to look at individual tasks
+        const size_t curComplete = group.submitted() - group.pending();
+        if (loggingFunc && (curComplete != lastSeenComplete)) {
+            auto endTime         = std::chrono::high_resolution_clock::now();
+            auto timeSinceUpdate = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
+
+            loggingFunc(group.pending(), curComplete - lastSeenComplete, timeSinceUpdate.count());
+
+            lastSeenComplete = curComplete;
+            startTime        = std::chrono::high_resolution_clock::now();
+        }
+    }
+
+    // Every task has finished, so the error (if any) can no longer change. The group is ready for
+    // reuse whether it failed, was cancelled or neither, unless its token was cancelled.
+    std::exception_ptr error = std::move(group.mError);
+    group.mError     = nullptr;
+    group.mFailed    = false;
+    group.mCancelled = false;
+    if (error) {
+        std::rethrow_exception(error);
+    }
 }
 
 bool Threadpool::is_ready(const Waitable& waitable)
 {
-    using namespace std::chrono_literals;
-    return waitable.wait_for(0s) == std::future_status::ready;
+    return waitable.is_ready();
 }
 
-bool Threadpool::has_jobs()
+Threadpool::Job* Threadpool::alloc_job(InplaceTask&& func, TaskGroup* group, uint32_t refs, Pool* owner)
 {
-    Threadpool& t = instance();
-    bool ret = false;
-    std::unique_lock<std::mutex> lock(t.mQMutex);
-    ret = !t.mQJobs.empty();
-    return ret;
+    Job* job      = JobPool<Job>::global().take();
+    job->func     = std::move(func);
+    job->priority = threadPriority;
+    job->rank     = 0;
+    job->state.store(Job::Pending, std::memory_order_relaxed);
+    job->refs.store(refs, std::memory_order_relaxed);
+    job->error    = nullptr;
+    job->group    = group;
+    job->owner    = owner;
+    job->next     = nullptr;
+    return job;
 }
 
-size_t Threadpool::num_jobs()
+void Threadpool::release_job(Job* job)
 {
-    Threadpool& t = instance();
-    size_t ret = 0;
-    std::unique_lock<std::mutex> lock(t.mQMutex);
-    ret = t.mQJobs.size();
-    return ret;
+    if (job->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        // Anything still here was never picked up by a Waitable or a TaskGroup
+        if (job->error) {
+            job->owner->set_unobserved_error(job->error);
+            job->error = nullptr;
+        }
+        JobPool<Job>::global().give(job);
+    }
+}
+
+void Threadpool::run_job(Job* job)
+{
+    if (job->group && job->group->cancelled()) {
+        // Never started, so it is skipped rather than run
+        job->group->mSkipped.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        try {
+            job->func();
+        }
+        catch (...) {
+            job->error = std::current_exception();
+        }
+    }
+    complete_job(job);
+}
+
+void Threadpool::complete_job(Job* job)
+{
+    job->func.reset(); // Release captures now rather than when the job is recycled
+
+    if (TaskGroup* group = job->group) {
+        if (job->error) {
+            group->set_error(job->error);
+            job->error = nullptr; // The group reports it
+        }
+        // Last touch of the group, its joiner may return and destroy it right after this
+        group->mPending.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    job->state.store(Job::Done, std::memory_order_release);
+    job->state.notify_all(); // For Waitable::wait(), we still hold a reference so the job can't be recycled yet
+    release_job(job);
+}
+
+void Threadpool::TaskGroup::set_error(const std::exception_ptr& error)
+{
+    // Only the first failure is kept
+    bool expected = false;
+    if (mFailed.compare_exchange_strong(expected, true)) {
+        mError = error;
+    }
+    // No point running the rest of the batch
+    cancel();
+}
+
+void Threadpool::TaskGroup::cancel()
+{
+    mCancelled.store(true, std::memory_order_release);
+    if (mToken) {
+        mToken->cancel();
+    }
+}
+
+Threadpool::Waitable& Threadpool::Waitable::operator=(Waitable&& other) noexcept
+{
+    if (this != &other) {
+        release();
+        mJob       = other.mJob;
+        other.mJob = nullptr;
+    }
+    return *this;
+}
+
+bool Threadpool::Waitable::is_ready() const
+{
+    return mJob && mJob->state.load(std::memory_order_acquire) == Job::Done;
+}
+
+void Threadpool::Waitable::wait() const
+{
+    if (mJob) {
+        mJob->state.wait(Job::Pending, std::memory_order_acquire);
+    }
 }
 
-bool Threadpool::do_work_nonblocking(bool allowLongWork)
+void Threadpool::Waitable::get()
+{
+    if (mJob) {
+        wait();
+        std::exception_ptr error = mJob->error;
+        mJob->error = nullptr; // Observed, so it isn't reported to the pool again
+        release();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+void Threadpool::Waitable::release()
+{
+    if (mJob) {
+        release_job(mJob);
+        mJob = nullptr;
+    }
+}
+
+bool Threadpool::Pool::do_work_nonblocking(bool allowLongWork)
 {
     bool ret = false;
-    std::packaged_task<void()> job;
-    {
+    Job* job = nullptr;
+    if (mMode == SchedulerMode::WorkStealing) {
+        // Going by the return value as do_work() does, job itself proves nothing
+        if (!try_take_job(job, allowLongWork || mPool.empty())) {
+            job = nullptr;
+        }
+    }
+    else {
         std::unique_lock<std::mutex> lock(mQMutex);
 
         // If we're allowed to do long-running work, go ahead and take a task if possible
         // If there are no worker threads available in the pool, go ahead and do work
         // If we're only allowed to do short work, and there's a high priority task on the queue, go ahead
-        if (!mQJobs.empty() && (allowLongWork || mPool.empty() || (mQJobs.top().first > 0))) {
+        if (!mQJobs.empty() && (allowLongWork || mPool.empty() || (mQJobs.top()->priority > 0))) {
             // At this point the queue has work and this thread was the first to see it,
             // so pull the next job off the list
-            auto pair = move(const_cast<PriorityTask&>(mQJobs.top())); // const_cast is necessary to maintain heap structure under pqueue, but we must immediately pop the object
-            job = move(pair.second);
+            job = mQJobs.top();
             mQJobs.pop();
-//            printf("%llu jobs left, max priority %d\n", mQJobs.size(), pair.first);
+            mNumQueued.fetch_sub(1);
+//            printf("%llu jobs left, max priority %d\n", mQJobs.size(), job->priority);
         }
         // Unlocked mQMutex
     }
 
-    if (job.valid()) {
+    if (job) {
         // Bracket the job with increasing priority so we do the child tasks first
         // We increase more here because we want to get back to any logging function asap
         threadPriority += 3;
         // Execute our job
-        job();
+        run_job(job);
         threadPriority -= 3;
         // Notify that a job has been completed
         mNumJobsComplete.fetch_add(1);
+        notify_waiters();
         ret = true;
     }
     return ret;
 }
 
-bool Threadpool::do_work()
+bool Threadpool::Pool::do_work()
 {
-    std::packaged_task<void()> job;
-    {
+    Job* job = nullptr;
+    if (mMode == SchedulerMode::WorkStealing) {
+        while (!try_take_job(job, true)) {
+            std::unique_lock<std::mutex> lock(mQMutex);
+
+            // mNumSleeping must be raised before checking mNumQueued, and enqueue() raises
+            // mNumQueued before checking mNumSleeping, so one side always sees the other
+            mNumSleeping.fetch_add(1);
+            while (mNumQueued.load() == 0 && !mbStopnow.load()) {
+                mJobAlert.wait(lock);
+            }
+            mNumSleeping.fetch_sub(1);
+
+            if (mbStopnow.load()) return false;
+        }
+    }
+    else {
         std::unique_lock<std::mutex> lock(mQMutex);
 
         while (mQJobs.empty() && !mbStopnow.load()) {  // Only block if there's no work to do
@@ -385,46 +984,242 @@ bool Threadpool::do_work()
 
         // At this point the queue has work and this thread was the first to see it,
         // so pull the next job off the list
-        auto pair = move(const_cast<PriorityTask&>(mQJobs.top())); // const_cast is necessary to maintain heap structure under pqueue, but we must immediately pop the object
-        job = move(pair.second);
+        job = mQJobs.top();
         mQJobs.pop();
+        mNumQueued.fetch_sub(1);
         // Unlocked mQMutex
     }
 
-    assert(job.valid());
+    assert(job);
 
     // Execute our job
     ++threadPriority;
-    job();
+    run_job(job);
     --threadPriority;
     // Notify that a job has been completed
     mNumJobsComplete.fetch_add(1);
+    notify_waiters();
     return true;
 }
 
-void Threadpool::waitForInFlight(size_t numInFlight)
+void Threadpool::Pool::waitForInFlight(size_t numInFlight)
 {
     assert(numInFlight > 0);
 
-    int timeout = 0;
     size_t curInFlight = mNumJobsSent - mNumJobsComplete;
     while (curInFlight >= numInFlight) {
-        if (timeout <= 0) {
-            if (!do_work_nonblocking(false)) {
-                // There wasn't work, so back off for a bit and then try again
-                timeout = TimeoutReset;
+        if (!do_work_nonblocking(false)) {
+            idle_wait([this, numInFlight]() { return mNumJobsSent - mNumJobsComplete < numInFlight; }, false);
+        }
+        curInFlight = mNumJobsSent - mNumJobsComplete;
+    }
+}
+
+
+template <typename Pred>
+void Threadpool::Pool::idle_wait(Pred&& done, bool allowLongWork)
+{
+    // Spin for a while first since the job we're waiting on is often nearly done.
+    // The spin budget adapts per thread: it grows when spinning pays off, and it
+    // shrinks whenever we end up having to sleep anyway.
+    static thread_local int spinLimit = TimeoutReset;
+
+    for (int spin = 0; spin < spinLimit; ++spin) {
+        if (done() || (allowLongWork && mNumQueued.load() > 0)) {
+            spinLimit = std::min(spinLimit * 2, TimeoutReset);
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    // Park until a job completes or new work shows up. Registering as a waiter
+    // before sampling the epoch and re-checking means notify_waiters() either sees
+    // us or we see its change, so the wakeup can't be lost.
+    numWaiters.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const uint32_t epoch = wakeEpoch.load();
+
+    // With no worker threads nobody else will run queued work, so never sleep on it
+    const bool canTakeWork = (allowLongWork || mPool.empty()) && mNumQueued.load() > 0;
+    if (!done() && !canTakeWork) {
+        wakeEpoch.wait(epoch);
+    }
+    numWaiters.fetch_sub(1);
+
+    spinLimit = std::max(spinLimit / 2, MinSpin);
+}
+
+void Threadpool::Pool::notify_waiters()
+{
+    // Common case is nobody waiting, which costs a fence and a load
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (numWaiters.load(std::memory_order_relaxed) > 0) {
+        wakeEpoch.fetch_add(1);
+        wakeEpoch.notify_all();
+    }
+}
+
+void Threadpool::Pool::set_unobserved_error(const std::exception_ptr& error)
+{
+    std::unique_lock<std::mutex> lock(mErrorMutex);
+    if (!mUnobservedError) {
+        mUnobservedError = error;
+    }
+}
+
+void Threadpool::Pool::enqueue(Job* job)
+{
+    if (workerPool == this && job->rank == 0) {
+        // Child task of one of our own workers, keep it local. The owner pops
+        // LIFO, so the newest (deepest) child runs first just like threadPriority.
+        mDeques[workerIndex]->push(job);
+        mNumQueued.fetch_add(1);
+        wake_workers(1);
+        notify_waiters();
+    }
+    else {
+        {
+            std::unique_lock<std::mutex> lock(mQMutex);
+            mQJobs.emplace(job);
+            mNumQueued.fetch_add(1);
+        }
+        mJobAlert.notify_one();
+        notify_waiters();
+    }
+}
+
+void Threadpool::Pool::enqueue(std::vector<Job*>& jobs)
+{
+    if (jobs.empty()) return;
+
+    if (workerPool == this) {
+        // Push in reverse so the owner still pops them in submission order
+        for (auto jobItr = jobs.rbegin(); jobItr != jobs.rend(); ++jobItr) {
+            mDeques[workerIndex]->push(*jobItr);
+        }
+        mNumQueued.fetch_add(jobs.size());
+        wake_workers(jobs.size());
+        notify_waiters();
+    }
+    else {
+        {
+            std::unique_lock<std::mutex> lock(mQMutex);
+            for (auto job : jobs) {
+                mQJobs.emplace(job);
             }
+            mNumQueued.fetch_add(jobs.size());
+        }
+        mJobAlert.notify_all();
+        notify_waiters();
+    }
+}
+
+void Threadpool::Pool::wake_workers(size_t numJobs)
+{
+    if (mNumSleeping.load() == 0) return; // Everyone is already busy or looking for work
+
+    {
+        // Taking the lock orders us after any worker that is between checking
+        // mNumQueued and actually waiting, so the notify can't be lost
+        std::unique_lock<std::mutex> lock(mQMutex);
+    }
+
+    if (numJobs > 1) {
+        mJobAlert.notify_all();
+    }
+    else {
+        mJobAlert.notify_one();
+    }
+}
+
+bool Threadpool::Pool::try_take_job(Job*& job, bool allowLongWork)
+{
+    const bool isWorker = workerPool == this;
+
+    // Our own deque first, newest child task first
+    if (isWorker && mDeques[workerIndex]->pop(job)) {
+        mNumQueued.fetch_sub(1);
+        return true;
+    }
+
+    if (mNumQueued.load() == 0) return false;
+
+    // Work that was submitted for our node
+    const bool   numaAware = !mNodeQueues.empty();
+    const size_t ownNode   = isWorker ? mWorkerNode[workerIndex] : 0;
+    if (isWorker && numaAware && try_take_node_job(job, ownNode, allowLongWork)) {
+        return true;
+    }
+
+    // Then work submitted from outside the pool, following the same rules as the shared queue
+    {
+        std::unique_lock<std::mutex> lock(mQMutex);
+        if (!mQJobs.empty() && (allowLongWork || (mQJobs.top()->priority > 0))) {
+            job = mQJobs.top();
+            mQJobs.pop();
+            mNumQueued.fetch_sub(1);
+            return true;
         }
-        else {
-            std::this_thread::yield(); // Spin lock while waiting for another thread to complete
-            --timeout;
+    }
+
+    // Then steal from the other workers, from our own node before crossing over.
+    // Everything on a deque was submitted by a worker, so it is always a child
+    // task and safe to take even if !allowLongWork.
+    if (isWorker && numaAware && try_steal(job, mNodeWorkers[ownNode])) {
+        return true;
+    }
+    if (try_steal(job, mAllWorkers)) {
+        return true;
+    }
+
+    // Last resort, work meant for another node is still better done remotely than not at all
+    for (size_t nodeIdx = 0; nodeIdx < mNodeQueues.size(); ++nodeIdx) {
+        if ((!isWorker || nodeIdx != ownNode) && try_take_node_job(job, nodeIdx, allowLongWork)) {
+            return true;
         }
-        curInFlight = mNumJobsSent - mNumJobsComplete;
     }
+
+    return false;
 }
 
+bool Threadpool::Pool::try_steal(Job*& job, const std::vector<size_t>& victims)
+{
+    // Start from a random victim so thieves spread out
+    static thread_local uint32_t seed = uint32_t(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    const size_t numVictims = victims.size();
+    for (size_t i = 0; i < numVictims; ++i) {
+        const size_t victim = victims[(seed + i) % numVictims];
+        if (workerPool == this && victim == workerIndex) continue;
+
+        if (mDeques[victim]->steal(job)) {
+            mNumQueued.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
 
-void Threadpool::shutdown()
+bool Threadpool::Pool::try_take_node_job(Job*& job, size_t nodeIdx, bool allowLongWork)
+{
+    NodeQueue& queue = *mNodeQueues[nodeIdx];
+    if (queue.size.load() == 0) return false;
+
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    if (!queue.jobs.empty() && (allowLongWork || queue.jobs.front()->priority > 0)) {
+        job = queue.jobs.front();
+        queue.jobs.pop_front();
+        queue.size.fetch_sub(1);
+        mNumQueued.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+void Threadpool::Pool::shutdown()
 {
     {
         mbStopnow = true;
@@ -439,23 +1234,51 @@ void Threadpool::shutdown()
         for (auto& child : mPool)
         {
             mJobAlert.notify_all(); // Continue to notify all to avoid join()ing a sleeping thread
-            if (child.joinable()) {
+            if (child->joinable()) {
 #if THREADPOOL_LOGGING
                 toLog.str(""); // Clear buffer
                 toLog.clear(); // Clear errors
-                toLog << "Waiting on [" << std::distance(begin(mPool), itr) << "] " << itr->get_id() << "\n";
+                toLog << mConfig.name << " waiting on [" << child->index << "]\n";
                 Logger::log(toLog, LogLevel::Debug);
 #endif
 
-                child.join();
+                child->join();
             }
         }
         mPool.clear();
     }
+
+    // Anything left behind is dropped, its waitables see a broken promise
+    const auto brokenPromise = std::make_exception_ptr(std::future_error(std::future_errc::broken_promise));
+    auto       dropJob       = [&brokenPromise](Job* job) {
+        job->error = brokenPromise;
+        complete_job(job);
+    };
+
+    Job* leftover = nullptr;
+    for (auto& deque : mDeques) {
+        while (deque->steal(leftover)) {
+            dropJob(leftover);
+        }
+    }
+    while (!mQJobs.empty()) {
+        dropJob(mQJobs.top());
+        mQJobs.pop();
+    }
+    for (auto& queue : mNodeQueues) {
+        for (auto job : queue->jobs) {
+            dropJob(job);
+        }
+        queue->jobs.clear();
+    }
 }
 
-void Threadpool::infinite_loop()
+void Threadpool::Pool::infinite_loop(size_t index)
 {
+    workerPool  = this;
+    workerIndex = index;
+    pin_worker(index);
+
     while (do_work()) {
         continue;
     }
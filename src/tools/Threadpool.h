@@ -22,79 +22,384 @@
 */
 #pragma once
 
+#include "InplaceTask.h"
+#include "WorkStealingDeque.h"
 
+#include <atomic>
+#include <algorithm>
 #include <condition_variable>
-#include <future>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <utility>
 
 class Threadpool
 {
+    struct Job;
+
 public:
+    class Pool;
+
+    // PriorityQueue: every thread shares one mutex-guarded priority queue
+    // WorkStealing:  each worker owns a deque, tasks submitted from a worker stay local
+    //                and idle workers steal from the others. Tasks submitted from outside
+    //                the pool still go through the shared priority queue.
+    enum class SchedulerMode { PriorityQueue,
+                               WorkStealing };
+
+    // Named pools, so that slow I/O never queues up behind (or starves) component work
+    enum class PoolId { Compute,  // CPU-bound component execution, the default for the static API
+                        IO,       // Data transfer and file loading
+                        Control,  // Small latency-sensitive bookkeeping, client requests
+                        Count };
+
+    struct Config {
+        std::string   name          = "compute";
+        unsigned int  numThreads    = 64;  // Upper bound, also clamped to the hardware threads left after reservedCores
+        unsigned int  reservedCores = 4;   // We don't want to render the system unusable
+        size_t        stackSize     = 0;   // Bytes per worker, 0 keeps the platform default
+        SchedulerMode mode          = SchedulerMode::PriorityQueue; // WorkStealing is opt in, tasks its workers submit bypass the priority queue
+        bool          pinWorkers    = false; // Bind each worker to one logical CPU, spread evenly across the NUMA nodes
+        bool          numaAware     = false; // WorkStealing only. Group workers by NUMA node: they steal from their own node
+                                             // first and honour submitOnNode(). Unpinned workers are still kept on their node.
+    };
+
+    // Handle to a submitted task, the replacement for std::future<void>.
+    // The completion state lives in a pooled Job, so waiting on a task costs no allocation.
+    class Waitable
+    {
+    public:
+        Waitable() noexcept : mJob(nullptr) {}
+        Waitable(Waitable&& other) noexcept : mJob(other.mJob) { other.mJob = nullptr; }
+        Waitable& operator=(Waitable&& other) noexcept;
+        ~Waitable() { release(); }
+
+        Waitable(const Waitable&)            = delete;
+        Waitable& operator=(const Waitable&) = delete;
+
+        bool valid() const { return mJob != nullptr; }
+        bool is_ready() const; // Never blocks
+        void wait() const;     // Blocks without helping, prefer Threadpool::join
+        void get();            // Waits, then rethrows anything the task threw. Leaves the Waitable invalid.
+
+    private:
+        friend class Threadpool;
+        explicit Waitable(Job* job) : mJob(job) {}
+        void release();
+
+        Job* mJob;
+    };
+
+    // Shared cancel flag, copies all refer to the same flag. Hand one to several TaskGroups
+    // (or TaskGraph::run) to cancel all of them together, eg when a client aborts a request.
+    class CancellationToken
+    {
+    public:
+        CancellationToken() : mState(std::make_shared<std::atomic<bool>>(false)) {}
+
+        void cancel() const          { mState->store(true, std::memory_order_release); }
+        bool cancelled() const       { return mState->load(std::memory_order_acquire); }
+
+    private:
+        std::shared_ptr<std::atomic<bool>> mState;
+    };
+
+    // Completion group for a batch of tasks, essentially a countdown latch.
+    // Every task submitted into a group decrements one counter when it finishes, so joining
+    // and progress logging only read that counter no matter how large the batch is.
+    // The first exception thrown by any task in the group cancels the group, and is rethrown
+    // by join(TaskGroup&). Tasks of a cancelled group that haven't started yet are skipped
+    // without ever running their callable, but still count as finished.
+    // A group must outlive the tasks submitted into it, so always join it before it goes away.
+    class TaskGroup
+    {
+    public:
+        TaskGroup() : mPending(0), mSubmitted(0), mSkipped(0), mFailed(false), mCancelled(false) {}
+        explicit TaskGroup(CancellationToken token) : TaskGroup() { mToken = std::make_unique<CancellationToken>(std::move(token)); }
+
+        TaskGroup(const TaskGroup&)            = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        size_t pending()   const { return mPending.load(std::memory_order_acquire); }
+        size_t submitted() const { return mSubmitted.load(std::memory_order_relaxed); }
+        size_t skipped()   const { return mSkipped.load(std::memory_order_relaxed); }
+        bool   done()      const { return pending() == 0; }
+        bool   failed()    const { return mFailed.load(); }
+
+        // Tasks already running finish normally, the queued ones are skipped. Also cancels the
+        // token the group was created with, and with it every other group sharing that token.
+        void cancel();
+        bool cancelled() const { return mCancelled.load(std::memory_order_acquire) || (mToken && mToken->cancelled()); }
+
+    private:
+        friend class Threadpool;
+        void set_error(const std::exception_ptr& error);
+
+        std::atomic<size_t> mPending;
+        std::atomic<size_t> mSubmitted;
+        std::atomic<size_t> mSkipped;
+        std::atomic<bool>   mFailed;
+        std::atomic<bool>   mCancelled;
+        std::exception_ptr  mError;    // Written once, by whoever flips mFailed
+        std::unique_ptr<CancellationToken> mToken; // Optional
+    };
+
     // [](size_t jobsCntLeft, size_t cycleCntJobs, int64_t cycleTimeMs)->void {}
     using LoggingFunc  = std::function<void(size_t, size_t, int64_t)>;
     using Task         = std::function<void()>;
     using TaskList     = std::vector<Task>;
-    using Waitable     = std::future<void>;
     using WaitableList = std::vector<Waitable>;
 
+private:
+    static const int TimeoutReset = 512; // Most a joining thread will spin before it sleeps
+    static const int MinSpin      = 16;
 
-    static Waitable submit(Task job, bool threaded = true);
-    static WaitableList submit(TaskList job_list, bool threaded = true); // Doesn't lock mutex more than once, but perhaps has some thread sleeping issues
+    // One submitted task. It is also the completion state its Waitable points at,
+    // and it is recycled through a pool rather than freed.
+    struct Job {
+        enum : uint32_t { Pending, Done };
 
-    // How many are left to go, How many finished since last update, How much time passed since last update
-    // Recommended signature:
-    static void join(LoggingFunc loggingFunc = LoggingFunc());                                             // Wait for all current tasks. WARNING: This does not propogate exceptions to the calling thread, exceptions are dropped
-    static void join(Waitable&&     waitable,  LoggingFunc loggingFunc = LoggingFunc());               // Wait for a single task
-    static void join(WaitableList&& waitables, LoggingFunc loggingFunc = LoggingFunc()); // Wait for many tasks
+        InplaceTask           func;
+        int                   priority;
+        int64_t               rank;  // Explicit scheduling rank, see submitRanked(). 0 for ordinary jobs.
+        std::atomic<uint32_t> state;
+        std::atomic<uint32_t> refs;  // One for the scheduler, one for the Waitable
+        std::exception_ptr    error;
+        TaskGroup*            group; // Optional, counted down when the job finishes
+        Pool*                 owner; // Told about exceptions that nobody else observed
+        Job*                  next;  // Free list link while pooled
+    };
 
-    // Use submitAndJoin when you need to limit the number of tasks in flight for example, file IO that needs to restrict number of active file handles
-    static void submitAndJoin(Task job,          bool threaded = true, LoggingFunc loggingFunc = LoggingFunc(), size_t inFlightLimit = SIZE_MAX); // Might block on call for a long time so logging is used as if joining previous results
-    static void submitAndJoin(TaskList job_list, bool threaded = true, LoggingFunc loggingFunc = LoggingFunc(), size_t inFlightLimit = SIZE_MAX); // Might block on call for a long time so logging is used as if joining previous results
+    // Job pooling and execution, shared by every pool
+    static Job* alloc_job(InplaceTask&& func, TaskGroup* group, uint32_t refs, Pool* owner);
+    static void release_job(Job* job); // The last reference reports an error that was never observed to the owner
+    static void run_job(Job* job);
+    static void complete_job(Job* job); // Publishes job->error and the done state, then drops the scheduler's reference
 
-    Threadpool(const Threadpool&)     = delete;
-    void operator=(const Threadpool&) = delete;
+    static bool is_ready(const Waitable& waitable);
 
-private:
-    static const int TimeoutReset = 512;
+public:
+    // One set of worker threads and its queues. The named pools are reached through
+    // Threadpool::pool(), but a Pool can also be created directly for private use.
+    // Every function mirrors the static Threadpool API of the same name.
+    class Pool
+    {
+    public:
+        Pool();
+        explicit Pool(const Config& config);
+        ~Pool();
 
-    Threadpool(unsigned int nThreads = 64);
-    ~Threadpool();
+        Pool(const Pool&)            = delete;
+        Pool& operator=(const Pool&) = delete;
 
-    // If we want to be returning as soon as possible, eg for logging,
-    // we don't want to allow long tasks to run on this thread, so we
-    // avoid doing priority 0 tasks.
-    bool do_work_nonblocking(bool allowLongWork = true); // Returns if it was able to do work or not
-    bool do_work();
+        template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+        Waitable submit(F&& job, bool threaded = true)
+        {
+            return submit_task(InplaceTask(std::forward<F>(job)), threaded);
+        }
+        WaitableList submit(TaskList job_list, bool threaded = true);
 
-    void waitForInFlight(size_t numInFlight);
+        template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+        void submit(TaskGroup& group, F&& job, bool threaded = true)
+        {
+            submit_task(group, InplaceTask(std::forward<F>(job)), threaded);
+        }
+        void submit(TaskGroup& group, TaskList job_list, bool threaded = true);
 
-    static bool is_ready(const std::future<void>& waitable);
-    static bool has_jobs();
-    static size_t num_jobs();
+        // Same as submit(), but the task is queued for the workers of one NUMA node (the OS node
+        // number, see CpuTopology), eg the node that owns the task's input buffers. Other nodes
+        // only pick it up once they run out of everything else. Without numaAware, or for an
+        // unknown node, this is a plain submit().
+        template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+        Waitable submitOnNode(int numaNode, F&& job)
+        {
+            return submit_task(InplaceTask(std::forward<F>(job)), true, numaNode);
+        }
+        template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+        void submitOnNode(TaskGroup& group, int numaNode, F&& job)
+        {
+            submit_task(group, InplaceTask(std::forward<F>(job)), true, numaNode);
+        }
 
-    static Threadpool& instance();
+        // Submits with an explicit rank instead of relying on submission depth alone, eg a
+        // TaskGraph node's critical path length. Higher ranks run first, and every ranked job
+        // goes before any unranked one. A per-worker deque can't keep a global order, so
+        // ranked jobs always go through the shared priority queue, even in WorkStealing mode.
+        template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+        void submitRanked(TaskGroup& group, int64_t rank, F&& job)
+        {
+            submit_task(group, InplaceTask(std::forward<F>(job)), true, -1, rank);
+        }
 
-    void infinite_loop();
-    void shutdown();
+        void join(LoggingFunc loggingFunc = LoggingFunc()); // Rethrows the first exception nobody observed, see the static join()
+        void join(Waitable&&     waitable,  LoggingFunc loggingFunc = LoggingFunc());
+        void join(WaitableList&& waitables, LoggingFunc loggingFunc = LoggingFunc());
+        void join(TaskGroup&     group,     LoggingFunc loggingFunc = LoggingFunc());
 
-    class compare_priority {
-    public:
-        bool operator()(const std::pair<int, std::packaged_task<void()>>& a, const std::pair<int, std::packaged_task<void()>>& b)
+        template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+        void submitAndJoin(F&& job, bool threaded = true, LoggingFunc loggingFunc = LoggingFunc(), size_t inFlightLimit = SIZE_MAX)
         {
-            return a.first < b.first;
+            if (inFlightLimit != SIZE_MAX) {
+                waitForInFlight(inFlightLimit);
+            }
+            join(submit(std::forward<F>(job), threaded), loggingFunc);
         }
+        void submitAndJoin(TaskList job_list, bool threaded = true, LoggingFunc loggingFunc = LoggingFunc(), size_t inFlightLimit = SIZE_MAX);
+
+        // Runs one queued job on the calling thread, if there is one. For a thread that waits on
+        // something only the pool's jobs bring about, other than a group or Waitable (join() already
+        // helps with those): helping keeps the wait from deadlocking when every worker is waiting
+        // the same way, or the pool has no workers at all.
+        bool run_one() { return do_work_nonblocking(); }
+
+        const Config& config()      const { return mConfig; }
+        size_t        num_threads() const { return mPool.size(); }
+        bool          has_jobs()    const { return mNumQueued.load() > 0; }
+        size_t        num_jobs()    const { return mNumQueued.load(); }
+        size_t        num_nodes()   const { return std::max<size_t>(mNodeQueues.size(), 1); }
+
+    private:
+        friend class Threadpool;
+        struct WorkerThread; // Native thread, std::thread can't set a stack size
+
+        Waitable submit_task(InplaceTask&& func, bool threaded, int numaNode = -1);
+        void     submit_task(TaskGroup& group, InplaceTask&& func, bool threaded, int numaNode = -1, int64_t rank = 0);
+        void schedule(Job* job, bool threaded, int numaNode = -1);
+        void schedule(std::vector<Job*>& jobs, bool threaded);
+
+        // If we want to be returning as soon as possible, eg for logging,
+        // we don't want to allow long tasks to run on this thread, so we
+        // avoid doing priority 0 tasks.
+        bool do_work_nonblocking(bool allowLongWork = true); // Returns if it was able to do work or not
+        bool do_work();
+
+        void waitForInFlight(size_t numInFlight);
+
+        // Called by joining threads that found no work they could do. Returns once
+        // done() holds, or something changed and the caller should look for work again.
+        template <typename Pred>
+        void idle_wait(Pred&& done, bool allowLongWork);
+        void notify_waiters(); // After a job completes or new work is queued
+        void set_unobserved_error(const std::exception_ptr& error);
+
+        void infinite_loop(size_t workerIndex);
+        void shutdown();
+
+        // Work-stealing mode helpers
+        void enqueue(Job* job);
+        void enqueue(std::vector<Job*>& jobs);
+        bool try_take_job(Job*& job, bool allowLongWork);
+        bool try_steal(Job*& job, const std::vector<size_t>& victims);
+        bool try_take_node_job(Job*& job, size_t nodeIdx, bool allowLongWork);
+        void wake_workers(size_t numJobs);
+
+        // NUMA placement, only set up when mConfig.numaAware
+        void place_workers(size_t numWorkers);
+        void pin_worker(size_t workerIndex);
+
+        struct NodeQueue {
+            std::mutex          mutex;
+            std::deque<Job*>    jobs;     // FIFO, submitOnNode() jobs for one node
+            std::atomic<size_t> size{0};  // So empty queues can be skipped without locking
+        };
+
+        // Ranked jobs first, highest rank first, then by depth
+        class compare_priority {
+        public:
+            bool operator()(const Job* a, const Job* b)
+            {
+                if (a->rank != b->rank) {
+                    return a->rank < b->rank;
+                }
+                return a->priority < b->priority;
+            }
+        };
+        using WorkerDeque = WorkStealingDeque<Job*>;
+
+        const Config                           mConfig;
+        const SchedulerMode                    mMode;
+        std::atomic<bool>                      mbStopnow;
+        std::condition_variable                mJobAlert;
+        std::mutex                             mQMutex;
+        std::priority_queue<Job*, std::vector<Job*>, compare_priority> mQJobs;
+        std::atomic<size_t>                    mNumJobsSent;
+        std::atomic<size_t>                    mNumJobsComplete;
+        std::vector<std::unique_ptr<WorkerThread>> mPool;
+        std::atomic<size_t>                    mNumQueued;      // Jobs sitting in mQJobs or any deque
+
+        // Only used in SchedulerMode::WorkStealing
+        std::vector<std::unique_ptr<WorkerDeque>> mDeques;      // One per worker thread, indexed like mPool
+        std::atomic<size_t>                    mNumSleeping;    // Workers parked on mJobAlert
+        std::vector<std::unique_ptr<NodeQueue>> mNodeQueues;    // One per NUMA node, indexed like CpuTopology::nodes()
+        std::vector<std::vector<size_t>>       mNodeWorkers;    // Worker indices on each node
+        std::vector<size_t>                    mWorkerNode;     // Node index of each worker
+        std::vector<int>                       mWorkerCpu;      // Logical CPU of each worker, -1 if not pinned
+        std::vector<std::vector<unsigned>>     mNodeCpus;       // CPUs of each node that workers may use
+        std::vector<size_t>                    mAllWorkers;     // 0..n-1, the steal order without numaAware
+
+        std::mutex                             mErrorMutex;
+        std::exception_ptr                     mUnobservedError; // First exception from a task whose Waitable was dropped unchecked
     };
-    using PriorityTask = std::pair<int, std::packaged_task<void()>>;
-
-    std::atomic<bool>                      mbStopnow;
-    std::condition_variable                mJobAlert;
-    std::mutex                             mQMutex;
-    std::priority_queue<PriorityTask, std::vector<PriorityTask>, compare_priority> mQJobs;
-    std::atomic<size_t>                    mNumJobsSent;
-    std::atomic<size_t>                    mNumJobsComplete;
-    std::vector<std::thread>               mPool;
+
+    // The named pools are created on first use. configure() only takes effect if it is
+    // called before that, and returns false once the pool already exists.
+    static Pool& pool(PoolId id = PoolId::Compute);
+    static bool  configure(PoolId id, const Config& config);
+
+    // The static API below runs everything on the compute pool
+
+    // Any callable works here and is perfectly forwarded into the task, so a lambda with
+    // a few captures is stored inline and never allocates. A Task converts just the same.
+    template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+    static Waitable submit(F&& job, bool threaded = true)
+    {
+        return pool().submit(std::forward<F>(job), threaded);
+    }
+    static WaitableList submit(TaskList job_list, bool threaded = true); // Doesn't lock mutex more than once, but perhaps has some thread sleeping issues
+
+    // Same as above, but completion is tracked by the group instead of a Waitable per task
+    template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+    static void submit(TaskGroup& group, F&& job, bool threaded = true)
+    {
+        pool().submit(group, std::forward<F>(job), threaded);
+    }
+    static void submit(TaskGroup& group, TaskList job_list, bool threaded = true);
+
+    // Keep a task on the NUMA node that owns its data, see Pool::submitOnNode
+    template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+    static Waitable submitOnNode(int numaNode, F&& job)
+    {
+        return pool().submitOnNode(numaNode, std::forward<F>(job));
+    }
+    template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+    static void submitOnNode(TaskGroup& group, int numaNode, F&& job)
+    {
+        pool().submitOnNode(group, numaNode, std::forward<F>(job));
+    }
+
+    // How many are left to go, How many finished since last update, How much time passed since last update
+    // Recommended signature:
+    static void join(LoggingFunc loggingFunc = LoggingFunc());                                             // Wait for all current tasks. Rethrows the first exception from a task whose Waitable was discarded without get(), those with a live Waitable or a TaskGroup are reported there instead
+    static void join(Waitable&&     waitable,  LoggingFunc loggingFunc = LoggingFunc());               // Wait for a single task
+    static void join(WaitableList&& waitables, LoggingFunc loggingFunc = LoggingFunc()); // Wait for many tasks
+    static void join(TaskGroup&     group,     LoggingFunc loggingFunc = LoggingFunc());  // Wait for every task in the group, rethrows the first exception
+
+    // Use submitAndJoin when you need to limit the number of tasks in flight for example, file IO that needs to restrict number of active file handles
+    template <typename F, typename = std::enable_if_t<std::is_invocable_v<std::decay_t<F>&>>>
+    static void submitAndJoin(F&& job, bool threaded = true, LoggingFunc loggingFunc = LoggingFunc(), size_t inFlightLimit = SIZE_MAX) // Might block on call for a long time so logging is used as if joining previous results
+    {
+        pool().submitAndJoin(std::forward<F>(job), threaded, loggingFunc, inFlightLimit);
+    }
+    static void submitAndJoin(TaskList job_list, bool threaded = true, LoggingFunc loggingFunc = LoggingFunc(), size_t inFlightLimit = SIZE_MAX); // Might block on call for a long time so logging is used as if joining previous results
+
+    Threadpool()                      = delete;
+    Threadpool(const Threadpool&)     = delete;
+    void operator=(const Threadpool&) = delete;
 };
@@ -1,59 +1,387 @@
 #include "Trie.h"
 
+#include <algorithm>
+#include <bit>
+#include <cstring>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TRIE_AVX2 1
+#endif
+
+
+Trie::Trie(Mode mode) : m_mode(mode)
+{
+    // Readers always have a table to match against, even before any key is added
+    publish(build(m_keys, m_mode, m_keySet));
+}
 
 void Trie::addEndpoint(std::string word, std::function<void(int)> endPoint, int arg)
 {
-    TrieNode* pCur = &root;
+    // Nothing to match on
+    if (word.empty())
+        return;
+
+    // The path is laid out by build(), which walks the keys in the order they were added.
+    // That keeps the numbering of existing nodes unchanged, so a match in progress survives.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_keys.push_back({std::move(word), std::move(endPoint), arg});
+    m_dirty.store(true, std::memory_order_relaxed);
+}
+
+void Trie::rebuild(std::vector<Key> keys)
+{
+    keys.erase(std::remove_if(keys.begin(), keys.end(), [](const Key& key) { return key.word.empty(); }), keys.end());
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_keys = std::move(keys);
+    m_keySet++;
+    m_dirty.store(false, std::memory_order_relaxed);
+    publish(build(m_keys, m_mode, m_keySet));
+}
 
-    // Create a path through the trie that follows the given string.
-    // At the end, the given function will be called with the provided argument.
-    for (size_t i = 0; i < word.length(); i++)
+void Trie::commit()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_dirty.load(std::memory_order_relaxed))
+        return;
+    m_dirty.store(false, std::memory_order_relaxed);
+    publish(build(m_keys, m_mode, m_keySet));
+}
+
+void Trie::process(const char* data, size_t length)
+{
+    if (m_dirty.load(std::memory_order_relaxed))
+        commit();
+    m_reader.process(data, length);
+}
+
+void Trie::publish(std::shared_ptr<const Table> table)
+{
+    // Readers take both under the same lock, so the generation they record is that of the table they got
+    std::lock_guard<std::mutex> lock(m_tableMutex);
+    m_table = std::move(table);
+    m_generation.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<const Trie::Table> Trie::build(const std::vector<Key>& keys, Mode mode, uint64_t keySet)
+{
+    auto table    = std::make_shared<Table>();
+    table->keySet = keySet;
+
+    // Give every character that appears in a key its own class, in order of first use
+    for (const Key& key : keys)
     {
-        char c = word.at(i);
+        for (const char c : key.word)
+        {
+            if (table->classOf[uint8_t(c)] == 0)
+                table->classOf[uint8_t(c)] = uint16_t(table->numClasses++);
+        }
+    }
+    const uint32_t numClasses = table->numClasses;
 
-        if (pCur->map.find(c) == pCur->map.end())
+    // Lay out the paths, as a list of children per node until it is known which way the rows are
+    // stored. Nodes are numbered as they are first reached, the root is node 0.
+    std::vector<uint32_t> firstChild(1, NO_NODE);
+    std::vector<uint32_t> nextSibling(1, NO_NODE);
+    std::vector<uint16_t> classOfNode(1, 0);
+    table->endpointOf.assign(1, NO_ENDPOINT);
+    table->endpoints.reserve(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        uint32_t node = 0;
+        for (const char c : keys[i].word)
         {
-            pCur->map.emplace(c, new TrieNode(nullptr, 0));
+            const uint16_t cls   = table->classOf[uint8_t(c)];
+            uint32_t       child = firstChild[node];
+            while (child != NO_NODE && classOfNode[child] != cls)
+                child = nextSibling[child];
+
+            if (child == NO_NODE)
+            {
+                child = uint32_t(classOfNode.size());
+                firstChild.push_back(NO_NODE);
+                nextSibling.push_back(firstChild[node]);
+                classOfNode.push_back(cls);
+                table->endpointOf.push_back(NO_ENDPOINT);
+                firstChild[node] = child;
+            }
+            node = child;
         }
+        table->endpointOf[node] = uint32_t(i);
+        table->endpoints.push_back({keys[i].func, keys[i].arg});
+    }
 
-        pCur = pCur->map.at(c);
+    const size_t numNodes = table->endpointOf.size();
+    table->suffixOf.assign(numNodes, NO_NODE);
+    table->sparse = numNodes * numClasses > DENSE_MAX_ENTRIES;
 
-        // We just placed the end node, add the function and arguments
-        if (i == word.length() - 1)
+    // The root always has a full row, that is where every match starts
+    std::vector<uint32_t>& next = table->next;
+    next.assign(table->sparse ? numClasses : numNodes * numClasses, 0);
+    for (uint32_t node = 0; node < (table->sparse ? 1 : numNodes); node++)
+    {
+        for (uint32_t child = firstChild[node]; child != NO_NODE; child = nextSibling[child])
+            next[size_t(node) * numClasses + classOfNode[child]] = child;
+    }
+
+    if (table->sparse)
+    {
+        // Every node's children in one array, by class, found with a binary search. A miss goes on
+        // from the failure node, so there is no row to fill in.
+        table->edgeStart.assign(numNodes + 1, 0);
+        for (size_t node = 1; node < numNodes; node++)
+        {
+            for (uint32_t child = firstChild[node]; child != NO_NODE; child = nextSibling[child])
+                table->edgeStart[node + 1]++;
+        }
+        for (size_t node = 0; node < numNodes; node++)
+            table->edgeStart[node + 1] += table->edgeStart[node];
+
+        std::vector<std::pair<uint16_t, uint32_t>> children;
+        table->edgeClass.resize(table->edgeStart[numNodes]);
+        table->edgeTarget.resize(table->edgeStart[numNodes]);
+        for (size_t node = 1; node < numNodes; node++)
+        {
+            children.clear();
+            for (uint32_t child = firstChild[node]; child != NO_NODE; child = nextSibling[child])
+                children.emplace_back(classOfNode[child], child);
+            std::sort(children.begin(), children.end());
+
+            uint32_t edge = table->edgeStart[node];
+            for (const auto& [cls, child] : children)
+            {
+                table->edgeClass[edge]  = cls;
+                table->edgeTarget[edge] = child;
+                edge++;
+            }
+        }
+
+        // Restart mode: a character off every path is tried again at the root
+        table->failOf.assign(numNodes, 0);
+        if (mode == Mode::AhoCorasick)
+            linkSparse(*table);
+    }
+    else if (mode == Mode::AhoCorasick)
+    {
+        link(*table);
+    }
+    else
+    {
+        // A character off every path restarts at the root and is tried again from there.
+        // If two words "$$ASCII" and "ACK" are in the trie, $$ACK goes root->$->$->A, which misses,
+        // and the A is retried at the root so the ACK is still found. The root's own misses stay 0.
+        for (size_t node = 1; node < numNodes; node++)
         {
-            pCur->arg  = arg;
-            pCur->func = endPoint;
+            uint32_t* row = &next[node * numClasses];
+            for (uint32_t cls = 0; cls < numClasses; cls++)
+            {
+                if (row[cls] == 0)
+                    row[cls] = next[cls];
+            }
         }
     }
+
+    // Mark the transitions that complete a key, so process() only looks further on those
+    for (std::vector<uint32_t>* targets : { &next, &table->edgeTarget })
+    {
+        for (uint32_t& target : *targets)
+        {
+            if (table->callable(target) || table->suffixOf[target] != NO_NODE)
+                target |= ENDPOINT_BIT;
+        }
+    }
+
+    findStarts(*table);
+    return table;
 }
 
-void Trie::process(const char c)
+void Trie::link(Table& table)
 {
-    // Take one step into the trie, and if the letter is not on any
-    // known path, restart at the beginning.
-    /// Note: Has known issues with overlapping keys and substring
-    ///       search but for the known CLI commands, it is sufficient
-    if (m_pCur->map.find(c) != m_pCur->map.end())
+    // Breadth first, so a node's failure node (always shallower) has its row complete before
+    // the node itself is reached. The failure node of a node is the longest proper suffix of its
+    // path that is also in the trie, a miss there is the same miss the node would take.
+    const uint32_t        numClasses = table.numClasses;
+    std::vector<uint32_t> failOf(table.endpointOf.size(), 0);
+    std::vector<uint32_t> queue;
+    queue.reserve(table.endpointOf.size());
+    for (uint32_t cls = 0; cls < numClasses; cls++)
     {
-        m_pCur = m_pCur->map.at(c);
-        if (m_pCur->func != nullptr)
-            m_pCur->func(m_pCur->arg);
+        if (table.next[cls] != 0)
+            queue.push_back(table.next[cls]);
     }
-    else
+
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        const uint32_t  node    = queue[i];
+        const uint32_t* failRow = &table.next[size_t(failOf[node]) * numClasses];
+        uint32_t*       row     = &table.next[size_t(node) * numClasses];
+        for (uint32_t cls = 0; cls < numClasses; cls++)
+        {
+            if (row[cls] == 0)
+            {
+                row[cls] = failRow[cls];
+                continue;
+            }
+
+            const uint32_t child  = row[cls];
+            const uint32_t fail   = failRow[cls];
+            failOf[child]         = fail;
+            table.suffixOf[child] = table.callable(fail) ? fail : table.suffixOf[fail];
+            queue.push_back(child);
+        }
+    }
+}
+
+void Trie::linkSparse(Table& table)
+{
+    // Same as link(), except the failure nodes are kept rather than folded into the rows. A
+    // node's failure node is shallower, so it is linked by the time stepSparse() goes through it.
+    std::vector<uint32_t> queue;
+    queue.reserve(table.endpointOf.size());
+    for (uint32_t cls = 0; cls < table.numClasses; cls++)
     {
-        m_pCur = &root;
+        if (table.next[cls] != 0)
+            queue.push_back(table.next[cls]);
+    }
 
-        // Immediately search root for another starting chain
-        // If two words "$$ASCII" and "ACK" are in the trie,
-        // $$ACK would traverse as root->$->$->A->root, but because
-        // another key starts with 'A', we want to immediately
-        // find root->$->$->A->root->A so we can continue down the next path
-        if (m_pCur->map.find(c) != m_pCur->map.end())
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        const uint32_t node = queue[i];
+        for (uint32_t edge = table.edgeStart[node]; edge < table.edgeStart[node + 1]; edge++)
         {
-            m_pCur = m_pCur->map.at(c);
-            if (m_pCur->func != nullptr)
-                m_pCur->func(m_pCur->arg);
+            const uint32_t child  = table.edgeTarget[edge];
+            const uint32_t fail   = table.stepSparse(table.failOf[node], table.edgeClass[edge]);
+            table.failOf[child]   = fail;
+            table.suffixOf[child] = table.callable(fail) ? fail : table.suffixOf[fail];
+            queue.push_back(child);
         }
     }
 }
+
+void Trie::findStarts(Table& table)
+{
+    // The start characters, also as a pair of nibble lookups for findStart(): each high nibble
+    // that begins some key gets one of 8 bucket bits, and a character is a candidate if its low
+    // nibble's entry shares a bit with its high nibble's. That is exact while the characters that
+    // begin keys have 8 different high nibbles or fewer, past that a few others come up as
+    // candidates too, which costs a step at the root and nothing else.
+    uint32_t numBuckets = 0;
+    for (uint32_t c = 0; c < 256; c++)
+    {
+        const uint16_t cls = table.classOf[c];
+        if (cls == 0 || (table.next[cls] & INDEX_MASK) == 0)
+            continue;
+
+        if (table.startHi[c >> 4] == 0)
+            table.startHi[c >> 4] = uint8_t(1u << (numBuckets++ % 8));
+        table.startLo[c & 0xF] |= table.startHi[c >> 4];
+        table.startsKey[c] = true;
+        table.firstStart   = char(c);
+        table.numStarts++;
+    }
+}
+
+void Trie::Table::fire(uint32_t node) const
+{
+    if (callable(node))
+    {
+        const Endpoint& endpoint = endpoints[endpointOf[node]];
+        endpoint.func(endpoint.arg);
+    }
+
+    // Shorter keys ending on the same character, only ever set in AhoCorasick mode
+    for (uint32_t suffix = suffixOf[node]; suffix != NO_NODE; suffix = suffixOf[suffix])
+    {
+        const Endpoint& endpoint = endpoints[endpointOf[suffix]];
+        endpoint.func(endpoint.arg);
+    }
+}
+
+uint32_t Trie::Table::stepSparse(uint32_t node, uint16_t cls) const
+{
+    // Down the failure nodes until one has an edge for the character, the root has them all
+    for (; node != 0; node = failOf[node])
+    {
+        const uint16_t* first = edgeClass.data() + edgeStart[node];
+        const uint16_t* last  = edgeClass.data() + edgeStart[node + 1];
+        const uint16_t* found = std::lower_bound(first, last, cls);
+        if (found != last && *found == cls)
+            return edgeTarget[size_t(found - edgeClass.data())];
+    }
+    return next[cls];
+}
+
+const char* Trie::Table::findStart(const char* data, const char* end) const
+{
+    if (numStarts == 0)
+        return end;
+    if (numStarts == 1)
+    {
+        const void* found = std::memchr(data, firstStart, size_t(end - data));
+        return found ? static_cast<const char*>(found) : end;
+    }
+
+#if TRIE_AVX2
+    const __m256i lo     = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(startLo.data())));
+    const __m256i hi     = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(startHi.data())));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    for (; end - data >= 32; data += 32)
+    {
+        const __m256i bytes   = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        const __m256i loBits  = _mm256_shuffle_epi8(lo, _mm256_and_si256(bytes, nibble));
+        const __m256i hiBits  = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        const __m256i misses  = _mm256_cmpeq_epi8(_mm256_and_si256(loBits, hiBits), _mm256_setzero_si256());
+        const uint32_t starts = ~uint32_t(_mm256_movemask_epi8(misses));
+        if (starts != 0)
+            return data + std::countr_zero(starts);
+    }
+#endif
+
+    for (; data < end; data++)
+    {
+        if (startsKey[uint8_t(*data)])
+            return data;
+    }
+    return end;
+}
+
+void Trie::Reader::process(const char* data, size_t length)
+{
+    if (m_generation != m_trie->m_generation.load(std::memory_order_acquire))
+        refresh();
+
+    // Held for the whole buffer, even if a callback publishes a new table meanwhile
+    const std::shared_ptr<const Table> table = m_table;
+    const char*                        end   = data + length;
+    while (data < end)
+    {
+        // Only at the root can a character be skipped, anywhere else it may continue a match
+        if (m_cur == 0 && !table->startsKey[uint8_t(*data)])
+        {
+            data = table->findStart(data + 1, end);
+            if (data == end)
+                break;
+        }
+
+        const uint32_t next = table->step(m_cur, *data++);
+        m_cur = next & INDEX_MASK;
+        if (next & ENDPOINT_BIT)
+            table->fire(m_cur);
+    }
+}
+
+void Trie::Reader::refresh()
+{
+    std::shared_ptr<const Table> table;
+    {
+        std::lock_guard<std::mutex> lock(m_trie->m_tableMutex);
+        m_generation = m_trie->m_generation.load(std::memory_order_acquire);
+        table        = m_trie->m_table;
+    }
+
+    // Added keys keep the numbering of the nodes already there, anything else starts over
+    if (!m_table || table->keySet != m_table->keySet)
+        m_cur = 0;
+    m_table = std::move(table);
+}
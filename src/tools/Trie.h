@@ -1,42 +1,183 @@
 #pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <functional>
-#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
+// Watches a stream of characters for keys, calling a key's endpoint as soon as its last
+// character has been processed. Two ways of matching:
+//  - Restart: a character that leaves every path restarts the match at the root, where it may
+//    begin another key. Enough for commands that don't overlap, but a key that starts inside
+//    a partial match of another one can be missed.
+//  - AhoCorasick: every key is found wherever it ends, however the keys overlap, still in one
+//    pass with no backtracking. A character that ends several keys at once ("SHE" and "HE")
+//    calls each of them, longest first.
+//
+// The keys are kept as one flat transition table rather than a tree of nodes: a node is a row,
+// and characters are mapped to classes (one per character used in some key, class 0 for all the
+// others) so rows stay short. Every row holds a complete set of transitions, misses included,
+// so a step is one table load. That costs numNodes * numClasses * 4 bytes, so past
+// DENSE_MAX_ENTRIES transitions (large key sets, eg tens of thousands of URIs) only the root keeps
+// a full row. Other nodes keep just their children, sorted for a binary search, and a miss goes on
+// from the node's failure node, so about 20 bytes per node. A table is never changed once built,
+// new keys build a new one which then replaces it whole, so for a while both are held. That
+// happens on the first process() after addEndpoint(), or at once for rebuild().
 class Trie
 {
 public:
-    Trie() : m_pCur(&root) {}
+    enum class Mode { Restart,
+                      AhoCorasick };
+
+    struct Key
+    {
+        std::string              word;
+        std::function<void(int)> func;
+        int                      arg = 0;
+    };
+
+    class Reader;
+
+    explicit Trie(Mode mode = Mode::Restart);
     ~Trie() {}
 
+    Trie(const Trie& t)            = delete; // Disallow copy constructor
+    Trie& operator=(const Trie& t) = delete; // Disallow copy assignment
+
     /*------------            Primary Interface             ------------*/
     void addEndpoint(std::string              word,
                      std::function<void(int)> endPoint,
                      int                      arg);
-    void process(const char c);
+
+    // Replaces every key at once, for reloading large key sets. The new table is built in full
+    // before it is swapped in, so a reader on another thread sees either the old keys or the new
+    // ones, never a mix. A match in progress is dropped. Safe to call while Readers are running.
+    void rebuild(std::vector<Key> keys);
+
+    // Publishes keys added since the last build, so Readers see them without waiting for this
+    // Trie's own next process()
+    void commit();
+
+    void process(const char c)
+    {
+        if (m_dirty.load(std::memory_order_relaxed))
+            commit();
+        m_reader.process(c);
+    }
+
+    // Same as calling process(char) on each character in turn. While no key is partly matched,
+    // characters that can't begin one are skipped with a vectorized scan, so text that mostly
+    // isn't keys goes by quickly.
+    void process(const char* data, size_t length);
+    void process(std::string_view text) { process(text.data(), text.size()); }
 
 protected:
     /*------------            Internal Data Definitions            ------------*/
-    struct TrieNode {
-        std::function<void(int arg)> func;
-        int                                      arg;
-        std::unordered_map<char, TrieNode*>      map;
-
-        TrieNode() : func(nullptr), arg(0) { map.clear(); }
-        TrieNode(std::function<void(int)> f, int a) : func(f), arg(a) {}
-        ~TrieNode()
+    static constexpr uint32_t ENDPOINT_BIT = 0x80000000u; // Set on transitions that complete at least one key
+    static constexpr uint32_t INDEX_MASK   = 0x7FFFFFFFu;
+    static constexpr uint32_t NO_ENDPOINT  = UINT32_MAX;
+    static constexpr uint32_t NO_NODE      = UINT32_MAX;
+    static constexpr size_t   DENSE_MAX_ENTRIES = size_t(1) << 22; // 16 MB of transitions, larger tables are sparse
+
+    struct Endpoint {
+        std::function<void(int)> func;
+        int                      arg;
+    };
+
+    // One complete set of keys, immutable once published. Nodes are rows of one table, so the
+    // whole structure goes with a handful of frees and no recursion, however many keys it has.
+    struct Table {
+        uint64_t                   keySet     = 0;       // Same for tables that only add keys, those keep the node numbers of the one before
+        std::vector<Endpoint>      endpoints;            // In the order added
+        std::array<uint16_t, 256>  classOf    = {};      // Character to column
+        uint32_t                   numClasses = 1;
+        std::vector<uint32_t>      next       = {0};     // numClasses transitions per node, the root is node 0. Only the root's if sparse.
+        std::vector<uint32_t>      endpointOf;           // Per node, index into endpoints or NO_ENDPOINT
+        std::vector<uint32_t>      suffixOf;             // Per node, the longest key that is a proper suffix of it, or NO_NODE
+
+        // Sparse tables only. The children of node n are edges edgeStart[n] to edgeStart[n + 1].
+        bool                       sparse     = false;
+        std::vector<uint32_t>      edgeStart;
+        std::vector<uint16_t>      edgeClass;            // Ascending within a node
+        std::vector<uint32_t>      edgeTarget;           // Flagged with ENDPOINT_BIT, as next is
+        std::vector<uint32_t>      failOf;               // Per node, where a miss goes on from. The root in Restart mode.
+
+        // Characters that begin a key, for skipping ahead while at the root
+        std::array<bool, 256>      startsKey  = {};
+        size_t                     numStarts  = 0;
+        char                       firstStart = 0;
+        std::array<uint8_t, 16>    startLo    = {};      // Per low nibble, the buckets of its high nibbles that begin a key
+        std::array<uint8_t, 16>    startHi    = {};      // Per high nibble, its bucket
+
+        uint32_t    step(uint32_t node, char c) const
         {
-            for (auto tNode : map)
-            {
-                if (tNode.second != nullptr) /// Should never be null but just in case
-                    delete tNode.second;     /// Could potentially stack overflow
-            }
+            if (!sparse) [[likely]]
+                return next[size_t(node) * numClasses + classOf[uint8_t(c)]];
+            return stepSparse(node, classOf[uint8_t(c)]);
         }
-        TrieNode(const TrieNode& t)            = delete; // Disallow copy constructor
-        TrieNode& operator=(const TrieNode& t) = delete; // Disallow copy assignment
+        uint32_t    stepSparse(uint32_t node, uint16_t cls) const;
+        bool        callable(uint32_t node) const { return endpointOf[node] != NO_ENDPOINT && endpoints[endpointOf[node]].func != nullptr; }
+        void        fire(uint32_t node) const;
+        const char* findStart(const char* data, const char* end) const; // First character that begins some key, or end
+    };
+
+    static std::shared_ptr<const Table> build(const std::vector<Key>& keys, Mode mode, uint64_t keySet);
+    static void link(Table& table);       // Aho-Corasick failure transitions
+    static void linkSparse(Table& table); // The same, for a sparse table
+    static void findStarts(Table& table);
+
+    void publish(std::shared_ptr<const Table> table);
+
+    Mode                                      m_mode;
+    std::mutex                                m_mutex;              // Held while keys change and tables are built
+    std::vector<Key>                          m_keys;               // In the order added, a later one for the same word wins
+    uint64_t                                  m_keySet     = 0;
+    std::atomic<bool>                         m_dirty      = false; // Keys added since the last build
+
+    // The published table. Readers only take the lock when the generation moves on, and never
+    // wait on a build, that happens under m_mutex.
+    mutable std::mutex                        m_tableMutex;
+    std::shared_ptr<const Table>              m_table;
+    std::atomic<uint64_t>                     m_generation = 0;     // Counts tables published
+
+public:
+    // Matches against a Trie's keys with its own match state, so any number of threads can each
+    // watch a stream of their own, while rebuild() runs. A new table is picked up at the start of
+    // the next process() call after it is published. Must not outlive its Trie.
+    class Reader
+    {
+    public:
+        explicit Reader(const Trie& trie) : m_trie(&trie) {}
+
+        void process(const char c)
+        {
+            if (m_generation != m_trie->m_generation.load(std::memory_order_acquire))
+                refresh();
+
+            const uint32_t next = m_table->step(m_cur, c);
+            m_cur = next & INDEX_MASK;
+            if (next & ENDPOINT_BIT)
+                m_table->fire(m_cur);
+        }
+
+        void process(const char* data, size_t length);
+        void process(std::string_view text) { process(text.data(), text.size()); }
+
+    private:
+        void refresh();
+
+        const Trie*                  m_trie;
+        std::shared_ptr<const Table> m_table;
+        uint64_t                     m_generation = 0; // Of m_table, the Trie publishes its first in the constructor
+
+        /*------------            Traversing State             ------------*/
+        uint32_t                     m_cur        = 0;
     };
 
-    /*------------            Traversing State             ------------*/
-    TrieNode  root;
-    TrieNode* m_pCur;
+private:
+    Reader m_reader { *this }; // For process() on the Trie itself
 };
@@ -0,0 +1,75 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include <streambuf>
+#include <string_view>
+
+// Read-only stream buffer over memory owned by someone else, eg a MappedFile.
+// Unlike std::stringbuf it never copies the data. The get pointer doubles as a cursor,
+// so code can scan the buffer directly and stay in step with the istream on top of it.
+class ViewStreamBuf : public std::streambuf {
+public:
+    ViewStreamBuf() = default;
+    explicit ViewStreamBuf(std::string_view view) { reset(view); }
+
+    void reset(std::string_view view) {
+        // The get area is never written through, only the streambuf interface wants it non-const
+        char* begin = const_cast<char*>(view.data());
+        setg(begin, begin, begin + view.size());
+    }
+
+    std::string_view view()      const { return std::string_view(eback(), size_t(egptr() - eback())); }
+    std::string_view remaining() const { return std::string_view(gptr(), size_t(egptr() - gptr())); }
+    size_t           position()  const { return size_t(gptr() - eback()); }
+
+    // Moves the cursor forward, n must not pass the end
+    void advance(size_t n) { setg(eback(), gptr() + n, egptr()); } // gbump() only takes an int
+    void seek(size_t pos)  { setg(eback(), eback() + pos, egptr()); }
+
+protected:
+    std::streamsize showmanyc() override {
+        return egptr() > gptr() ? std::streamsize(egptr() - gptr()) : std::streamsize(-1);
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        if (!(which & std::ios_base::in)) return pos_type(off_type(-1));
+
+        off_type base = 0;
+        if (dir == std::ios_base::cur) {
+            base = off_type(gptr() - eback());
+        }
+        else if (dir == std::ios_base::end) {
+            base = off_type(egptr() - eback());
+        }
+        return seekpos(pos_type(base + off), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        const off_type off = off_type(pos);
+        if (!(which & std::ios_base::in) || off < 0 || off > off_type(egptr() - eback())) {
+            return pos_type(off_type(-1));
+        }
+        seek(size_t(off));
+        return pos;
+    }
+};
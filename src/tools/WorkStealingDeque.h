@@ -0,0 +1,169 @@
+/*************************************************************************
+*
+* VULCANFORMS CONFIDENTIAL
+* __________________
+*  Copyright, VulcanForms Inc.
+*  [2016] - [2021] VulcanForms Incorporated
+*  All Rights Reserved.
+*
+*  "VulcanForms", "Vulcan", "Fusing the Future"
+*       are trademarks of VulcanForms, Inc.
+*
+* NOTICE:  All information contained herein is, and remains
+* the property of VulcanForms Incorporated and its suppliers,
+* if any.  The intellectual and technical concepts contained
+* herein are proprietary to VulcandForms Incorporated
+* and its suppliers and may be covered by U.S. and Foreign Patents,
+* patents in process, and are protected by trade secret or copyright law.
+* Dissemination of this information or reproduction of this material
+* is strictly forbidden unless prior written permission is obtained
+* from VulcanForms Incorporated.
+*/
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Chase-Lev work-stealing deque, using the memory orderings from
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et al. 2013).
+//
+// Only the owning thread may push() and pop(), and it does so at the bottom (LIFO).
+// Any thread may steal() from the top (FIFO), so the oldest and usually largest
+// tasks are the ones that migrate to other threads.
+//
+// T must be trivially copyable, in practice a pointer to the real work item.
+template <typename T>
+class WorkStealingDeque
+{
+    static_assert(std::is_trivially_copyable_v<T>, "WorkStealingDeque stores items in std::atomic");
+
+public:
+    explicit WorkStealingDeque(int64_t initialCapacity = 1024) :
+        mTop(0),
+        mBottom(0)
+    {
+        // Capacity must be a power of two so indices can be masked
+        int64_t capacity = 1;
+        while (capacity < initialCapacity) {
+            capacity <<= 1;
+        }
+        mRings.emplace_back(std::make_unique<Ring>(capacity));
+        mRing.store(mRings.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&)            = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    // Owner only
+    void push(T item)
+    {
+        const int64_t b = mBottom.load(std::memory_order_relaxed);
+        const int64_t t = mTop.load(std::memory_order_acquire);
+        Ring*         r = mRing.load(std::memory_order_relaxed);
+
+        if (b - t > r->capacity - 1) {
+            r = grow(r, b, t);
+        }
+
+        r->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        mBottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only, takes the most recently pushed item
+    bool pop(T& item)
+    {
+        const int64_t b = mBottom.load(std::memory_order_relaxed) - 1;
+        Ring*         r = mRing.load(std::memory_order_relaxed);
+        mBottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = mTop.load(std::memory_order_relaxed);
+
+        bool ret = false;
+        if (t <= b) {
+            const T taken = r->get(b);
+            ret           = true;
+            if (t == b) {
+                // Last item, we have to race the stealers for it
+                if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    ret = false;
+                }
+                mBottom.store(b + 1, std::memory_order_relaxed);
+            }
+            // Only handed out once it is ours, a lost race leaves item untouched
+            if (ret) {
+                item = taken;
+            }
+        }
+        else {
+            mBottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return ret;
+    }
+
+    // Any thread, takes the oldest item. May fail spuriously if it loses a race.
+    bool steal(T& item)
+    {
+        int64_t t = mTop.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t b = mBottom.load(std::memory_order_acquire);
+
+        if (t < b) {
+            Ring* r   = mRing.load(std::memory_order_acquire);
+            T     ret = r->get(t);
+            if (mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                item = ret;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Only a hint, the deque can change underneath the caller
+    bool empty() const
+    {
+        return mBottom.load(std::memory_order_relaxed) <= mTop.load(std::memory_order_relaxed);
+    }
+
+    size_t size() const
+    {
+        const int64_t b = mBottom.load(std::memory_order_relaxed);
+        const int64_t t = mTop.load(std::memory_order_relaxed);
+        return b > t ? size_t(b - t) : 0;
+    }
+
+private:
+    struct Ring {
+        int64_t                           capacity;
+        int64_t                           mask;
+        std::unique_ptr<std::atomic<T>[]> items;
+
+        explicit Ring(int64_t cap) : capacity(cap), mask(cap - 1), items(new std::atomic<T>[size_t(cap)]) {}
+
+        T    get(int64_t i) const  { return items[i & mask].load(std::memory_order_relaxed); }
+        void put(int64_t i, T val) { items[i & mask].store(val, std::memory_order_relaxed); }
+    };
+
+    Ring* grow(Ring* old, int64_t b, int64_t t)
+    {
+        auto bigger = std::make_unique<Ring>(old->capacity * 2);
+        for (int64_t i = t; i < b; ++i) {
+            bigger->put(i, old->get(i));
+        }
+
+        // Stealers may still be reading from the old ring, so it is kept
+        // alive until the deque itself is destroyed
+        Ring* ret = bigger.get();
+        mRings.emplace_back(std::move(bigger));
+        mRing.store(ret, std::memory_order_release);
+        return ret;
+    }
+
+    alignas(64) std::atomic<int64_t> mTop;
+    alignas(64) std::atomic<int64_t> mBottom;
+    std::atomic<Ring*>                 mRing;
+    std::vector<std::unique_ptr<Ring>> mRings; // Owner only, current ring is the last one
+};